@@ -2,14 +2,42 @@
 #include <cstdint>
 #include <cstdlib>
 #include <iostream>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 void *my_buf;
 uint8_t* buf_start;
 uint8_t* buf_end;
 
+// Движок аллокатора.
+// ByteMarkers - маркеры и размеры на обоих концах каждого блока.
+// Bitmap - буфер делится на гранулы по GRANULE_SIZE байт, а их состояние хранится
+//          в двух битовых картах в начале буфера: занята ли гранула и начинается
+//          ли с нее блок. Свободные участки ищутся по словам карты, не трогая
+//          сами блоки.
+enum class Engine {
+    ByteMarkers,
+    Bitmap,
+};
+
+Engine engine = Engine::ByteMarkers;
+
+const std::size_t GRANULE_SIZE = 16;
+const std::size_t WORD_BITS = 64;
+const std::uint64_t FULL_WORD = ~static_cast<std::uint64_t>(0);
+
+std::uint64_t* alloc_bits;
+std::uint64_t* start_bits;
+std::size_t bitmap_words;
+std::size_t granules_count;
+uint8_t* granules_start;
+// Все слова карты до search_hint полностью заняты
+std::size_t search_hint;
+
 std::size_t additional_size = sizeof(uint8_t) * 2 + sizeof(std::size_t) * 2;
 
-void* set_bool_mask(void *block, std::size_t block_size, uint8_t bool_mask)
+void set_bool_mask(void *block, std::size_t block_size, uint8_t bool_mask)
 {
     uint8_t* block_addr = static_cast<uint8_t*>(block);
     uint8_t* block_end_addr = block_addr + block_size - sizeof(uint8_t);
@@ -18,7 +46,7 @@ void* set_bool_mask(void *block, std::size_t block_size, uint8_t bool_mask)
     *block_end_addr = bool_mask;
 }
 
-void* set_data_to_block(void *p, std::size_t block_size, uint8_t bool_mask)
+void set_data_to_block(void *p, std::size_t block_size, uint8_t bool_mask)
 {
     set_bool_mask(p, block_size, bool_mask);
     uint8_t* p_addr = static_cast<uint8_t*>(p);
@@ -31,6 +59,16 @@ void* set_data_to_block(void *p, std::size_t block_size, uint8_t bool_mask)
     *p_size_end_ptr = size;
 }
 
+void bitmap_setup(void *buf, std::size_t size);
+void *bitmap_alloc(std::size_t size);
+void bitmap_free(void *p);
+
+// Выбор движка, вызывается до mysetup.
+void myset_engine(Engine new_engine)
+{
+    engine = new_engine;
+}
+
 // Эта функция будет вызвана перед тем как вызывать myalloc и myfree
 // используйте ее чтобы инициализировать ваш аллокатор перед началом
 // работы.
@@ -41,6 +79,10 @@ void* set_data_to_block(void *p, std::size_t block_size, uint8_t bool_mask)
 // size - размер участка памяти, на который указывает buf
 void mysetup(void *buf, std::size_t size)
 {
+    if (engine == Engine::Bitmap) {
+        bitmap_setup(buf, size);
+        return;
+    }
     my_buf = buf;
     buf_start = static_cast<uint8_t*>(buf);
     buf_end = buf_start + size;
@@ -84,6 +126,9 @@ void* next_block(void *p) {
 // Функция аллокации
 void *myalloc(std::size_t size)
 {
+    if (engine == Engine::Bitmap) {
+        return bitmap_alloc(size);
+    }
     //std::cout << "Allocating size " << size << "\n";
     void* curr = nullptr;
     bool found = false;
@@ -127,6 +172,10 @@ void *myalloc(std::size_t size)
 // Функция освобождения
 void myfree(void *p)
 {
+    if (engine == Engine::Bitmap) {
+        bitmap_free(p);
+        return;
+    }
     if (p == nullptr) {
         return;
     }
@@ -153,6 +202,182 @@ void myfree(void *p)
     }
 }
 
+// Выставляет или сбрасывает биты [from, to) карты
+void set_bits_range(std::uint64_t* bits, std::size_t from, std::size_t to, bool value)
+{
+    while (from < to) {
+        std::size_t word = from / WORD_BITS;
+        std::size_t bit = from % WORD_BITS;
+        std::size_t count = WORD_BITS - bit < to - from ? WORD_BITS - bit : to - from;
+        std::uint64_t mask = count == WORD_BITS ? FULL_WORD : ((static_cast<std::uint64_t>(1) << count) - 1) << bit;
+        if (value) {
+            bits[word] |= mask;
+        } else {
+            bits[word] &= ~mask;
+        }
+        from += count;
+    }
+}
+
+// Первое слово начиная с word, в котором есть свободные гранулы
+std::size_t skip_allocated_words(std::size_t word)
+{
+#ifdef __AVX2__
+    // Проверяем сразу по 4 слова
+    const __m256i full = _mm256_set1_epi64x(-1);
+    while (word + 4 <= bitmap_words) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(alloc_bits + word));
+        if (!_mm256_testc_si256(chunk, full)) {
+            break;
+        }
+        word += 4;
+    }
+#endif
+    while (word < bitmap_words && alloc_bits[word] == FULL_WORD) {
+        word++;
+    }
+    return word;
+}
+
+// Ищет первый участок из count свободных гранул, возвращает номер
+// его первой гранулы или granules_count, если такого участка нет
+std::size_t find_free_run(std::size_t count)
+{
+    std::size_t run_start = 0;
+    std::size_t run_length = 0;
+    for (std::size_t word = search_hint; word < bitmap_words; word++) {
+        if (run_length == 0) {
+            word = skip_allocated_words(word);
+            if (word == bitmap_words) {
+                break;
+            }
+        }
+
+        std::uint64_t free_bits = ~alloc_bits[word];
+        if (free_bits == FULL_WORD) {
+            if (run_length == 0) {
+                run_start = word * WORD_BITS;
+            }
+            run_length += WORD_BITS;
+            if (run_length >= count) {
+                return run_start;
+            }
+            continue;
+        }
+
+        // Идем по чередующимся отрезкам занятых и свободных бит внутри слова
+        std::size_t bit = 0;
+        while (bit < WORD_BITS) {
+            std::uint64_t rest = free_bits >> bit;
+            if (rest == 0) {
+                run_length = 0;
+                break;
+            }
+            std::size_t allocated = __builtin_ctzll(rest);
+            if (allocated != 0) {
+                run_length = 0;
+                bit += allocated;
+                continue;
+            }
+            // Сдвиг вдвигает сверху нули, поэтому ~rest не бывает нулем
+            std::size_t free_count = __builtin_ctzll(~rest);
+            if (run_length == 0) {
+                run_start = word * WORD_BITS + bit;
+            }
+            run_length += free_count;
+            if (run_length >= count) {
+                return run_start;
+            }
+            bit += free_count;
+        }
+    }
+    return granules_count;
+}
+
+// Конец блока, начинающегося с гранулы first: первая гранула после first,
+// которая свободна или начинает другой блок
+std::size_t find_block_end(std::size_t first)
+{
+    std::size_t granule = first + 1;
+    while (granule < granules_count) {
+        std::size_t word = granule / WORD_BITS;
+        std::size_t bit = granule % WORD_BITS;
+        std::uint64_t stop_bits = (~alloc_bits[word] | start_bits[word]) >> bit;
+        if (stop_bits != 0) {
+            return granule + __builtin_ctzll(stop_bits);
+        }
+        granule += WORD_BITS - bit;
+    }
+    return granules_count;
+}
+
+void bitmap_setup(void *buf, std::size_t size)
+{
+    my_buf = buf;
+    buf_start = static_cast<uint8_t*>(buf);
+    buf_end = buf_start + size;
+
+    // Карты лежат в начале буфера, гранулы - сразу после них
+    uintptr_t addr = reinterpret_cast<uintptr_t>(buf);
+    uintptr_t aligned = (addr + GRANULE_SIZE - 1) & ~(GRANULE_SIZE - 1);
+    std::size_t usable = size - (aligned - addr);
+    bitmap_words = (usable / GRANULE_SIZE + WORD_BITS - 1) / WORD_BITS;
+    std::size_t bitmap_bytes = 2 * bitmap_words * sizeof(std::uint64_t);
+    bitmap_bytes = (bitmap_bytes + GRANULE_SIZE - 1) & ~(GRANULE_SIZE - 1);
+    granules_count = (usable - bitmap_bytes) / GRANULE_SIZE;
+
+    alloc_bits = reinterpret_cast<std::uint64_t*>(aligned);
+    start_bits = alloc_bits + bitmap_words;
+    granules_start = reinterpret_cast<uint8_t*>(aligned) + bitmap_bytes;
+    search_hint = 0;
+
+    for (std::size_t i = 0; i < bitmap_words; i++) {
+        alloc_bits[i] = 0;
+        start_bits[i] = 0;
+    }
+    // Хвост последнего слова за пределами буфера считаем занятым отдельным блоком
+    set_bits_range(alloc_bits, granules_count, bitmap_words * WORD_BITS, true);
+    set_bits_range(start_bits, granules_count, bitmap_words * WORD_BITS, true);
+}
+
+void *bitmap_alloc(std::size_t size)
+{
+    std::size_t count = size == 0 ? 1 : (size + GRANULE_SIZE - 1) / GRANULE_SIZE;
+    std::size_t first = find_free_run(count);
+    if (first == granules_count) {
+        return NULL;
+    }
+
+    set_bits_range(alloc_bits, first, first + count, true);
+    set_bits_range(start_bits, first, first + 1, true);
+    if (first / WORD_BITS == search_hint) {
+        search_hint = skip_allocated_words(search_hint);
+    }
+    return granules_start + first * GRANULE_SIZE;
+}
+
+void bitmap_free(void *p)
+{
+    uint8_t* addr = static_cast<uint8_t*>(p);
+    if (addr == nullptr || addr < granules_start) {
+        return;
+    }
+    std::size_t first = (addr - granules_start) / GRANULE_SIZE;
+    if (first >= granules_count) {
+        return;
+    }
+
+    // Соседние свободные гранулы сливаются сами - отдельного слияния блоков не нужно
+    std::size_t end = find_block_end(first);
+    set_bits_range(alloc_bits, first, end, false);
+    set_bits_range(start_bits, first, first + 1, false);
+    if (first / WORD_BITS < search_hint) {
+        search_hint = first / WORD_BITS;
+    }
+}
+
+// Демонстрационный main, бенчмарк alloc_bench подключает файл без него
+#ifndef ALLOC_BENCH
 int main(int argc, char const *argv[])
 {
     std::size_t size = 1024;
@@ -210,5 +435,16 @@ int main(int argc, char const *argv[])
     std::size_t allocated_addr_1_size_after_4_free = get_size(block_1_addr);
     std::cout << "My allocate 1 size after allocate 4 free: " << allocated_addr_1_size_after_4_free << "\n";
 
+    myset_engine(Engine::Bitmap);
+    mysetup(buf, size);
+    void* bitmap_addr_1 = myalloc(512);
+    void* bitmap_addr_2 = myalloc(256);
+    std::cout << "Bitmap granules: " << granules_count << ", allocate 1: " << bitmap_addr_1
+              << ", allocate 2: " << bitmap_addr_2 << "\n";
+    myfree(bitmap_addr_1);
+    void* bitmap_addr_3 = myalloc(500);
+    std::cout << "Bitmap allocate 3 (reuses allocate 1): " << bitmap_addr_3 << "\n";
+
     return 0;
 }
+#endif
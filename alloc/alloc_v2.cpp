@@ -1,28 +1,547 @@
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <mutex>
 
+// Заголовок блока: полный размер блока вместе с заголовком (кратен ALIGNMENT)
+// и флаги в младших битах. У свободного блока в последних байтах лежит
+// копия размера (footer), поэтому соседей блока можно найти за O(1):
+// следующий - сразу за блоком, предыдущий - по footer-у перед заголовком,
+// если у текущего блока стоит PREV_FREE_BIT.
 struct Node {
-    std::size_t size;
-    bool is_empty;
-    Node *next;
-    Node *prev;
+    std::size_t size_and_flags;
 };
 
-Node* head;
+const std::size_t FREE_BIT = 1;
+const std::size_t PREV_FREE_BIT = 2;
+const std::size_t FLAGS_MASK = FREE_BIT | PREV_FREE_BIT;
 
-void join_node_with_next(Node* curr)
+// Ссылки списка свободных блоков одного размерного класса.
+// Хранятся прямо в данных свободного блока.
+struct FreeLinks {
+    Node *next_free;
+    Node *prev_free;
+};
+
+// В режиме BestFit то же место в данных свободного блока занимают
+// ссылки на детей в splay-дереве свободных блоков.
+struct TreeLinks {
+    Node *left;
+    Node *right;
+};
+
+// Политика поиска свободного блока в myalloc.
+// FirstFit - линейный проход по всем блокам от head.
+// NextFit - линейный проход, продолжающийся с места последней аллокации.
+// SegregatedFit - двухуровневые размерные классы (как в TLSF)
+//                 с битовыми масками непустых классов, поиск за O(1).
+// BestFit - наименьший подходящий блок из дерева, упорядоченного по
+//           размеру, за амортизированный O(log n).
+enum class FitPolicy {
+    FirstFit,
+    NextFit,
+    SegregatedFit,
+    BestFit,
+};
+
+// Состояние свободной памяти для выбора политики под нагрузку
+struct HeapStats {
+    std::size_t free_bytes;
+    std::size_t free_blocks;
+    std::size_t largest_free_block;
+    // 1 - largest_free_block / free_bytes: 0, если вся свободная память
+    // одним куском, и ближе к 1, чем мельче она раздроблена
+    double external_fragmentation;
+};
+
+const int ALIGNMENT_LOG2 = 4;
+const std::size_t ALIGNMENT = 1 << ALIGNMENT_LOG2;
+
+// Свободный блок должен вмещать заголовок, ссылки и footer
+const std::size_t MIN_BLOCK_SIZE = sizeof(Node) + sizeof(FreeLinks) + sizeof(std::size_t);
+
+// Второй уровень делит каждый диапазон [2^k, 2^(k+1)) на SL_COUNT классов.
+// Размеры меньше SMALL_BLOCK_SIZE лежат в первом диапазоне с шагом ALIGNMENT.
+const int SL_LOG2 = 4;
+const int SL_COUNT = 1 << SL_LOG2;
+const int FL_SHIFT = SL_LOG2 + ALIGNMENT_LOG2;
+const std::size_t SMALL_BLOCK_SIZE = 1 << FL_SHIFT;
+const int FL_COUNT = 64 - FL_SHIFT + 1;
+
+FitPolicy fit_policy = FitPolicy::FirstFit;
+
+// Куча над непрерывным участком памяти. Однопоточные функции работают
+// с main_heap на весь буфер из mysetup, а многопоточный режим делит
+// буфер на несколько таких куч со своими блокировками (см. MtArena).
+// Блоки не пересекают границы куч, поэтому кучи независимы.
+struct Heap {
+    Node* head;
+    std::uint8_t* heap_end;
+
+    // Битовая маска непустых классов первого уровня и для каждого из них
+    // маска непустых классов второго уровня.
+    std::uint64_t fl_bitmap;
+    std::uint32_t sl_bitmap[FL_COUNT];
+    Node* free_lists[FL_COUNT][SL_COUNT];
+
+    // Корень дерева свободных блоков для BestFit
+    Node* free_tree;
+    // Блок, с которого NextFit начнет следующий поиск
+    Node* next_fit_rover;
+
+    std::size_t free_bytes;
+    std::size_t free_blocks;
+};
+
+Heap main_heap;
+
+// Номер текущего буфера, увеличивается при каждом mysetup
+std::atomic<std::uint64_t> heap_generation(0);
+
+std::size_t block_size(Node* node)
+{
+    return node->size_and_flags & ~FLAGS_MASK;
+}
+
+bool is_free(Node* node)
+{
+    return (node->size_and_flags & FREE_BIT) != 0;
+}
+
+bool is_prev_free(Node* node)
+{
+    return (node->size_and_flags & PREV_FREE_BIT) != 0;
+}
+
+void set_block_size(Node* node, std::size_t size)
+{
+    node->size_and_flags = size | (node->size_and_flags & FLAGS_MASK);
+}
+
+// PREV_FREE меняется в заголовке соседнего блока, который в многопоточном
+// режиме может одновременно читать его владелец (см. myfree_mt), поэтому
+// слово заголовка читается и пишется атомарно. Писатели сериализованы
+// mutex-ом арены (блоки не пересекают границы арен), так что хватает
+// relaxed load/store без RMW.
+void set_flag(Node* node, std::size_t flag, bool value)
+{
+    std::size_t header = __atomic_load_n(&node->size_and_flags, __ATOMIC_RELAXED);
+    header = value ? header | flag : header & ~flag;
+    __atomic_store_n(&node->size_and_flags, header, __ATOMIC_RELAXED);
+}
+
+FreeLinks* links(Node* node)
+{
+    return reinterpret_cast<FreeLinks *>(node + 1);
+}
+
+std::size_t* footer(Node* node)
+{
+    return reinterpret_cast<std::size_t *>(reinterpret_cast<std::uint8_t *>(node) + block_size(node)) - 1;
+}
+
+// Следующий по адресу блок или nullptr, если node последний в буфере
+Node* next_node(Heap* heap, Node* node)
+{
+    std::uint8_t* next = reinterpret_cast<std::uint8_t *>(node) + block_size(node);
+    return next < heap->heap_end ? reinterpret_cast<Node *>(next) : nullptr;
+}
+
+// Предыдущий по адресу блок, известен только если он свободен
+Node* prev_free_node(Node* node)
+{
+    if (!is_prev_free(node)) {
+        return nullptr;
+    }
+    std::size_t prev_size = *(reinterpret_cast<std::size_t *>(node) - 1);
+    return reinterpret_cast<Node *>(reinterpret_cast<std::uint8_t *>(node) - prev_size);
+}
+
+// Помечает блок занятым или свободным, поддерживая footer
+// и флаг PREV_FREE у следующего блока
+void mark_block(Heap* heap, Node* node, bool free)
+{
+    set_flag(node, FREE_BIT, free);
+    if (free) {
+        *footer(node) = block_size(node);
+    }
+    Node* next = next_node(heap, node);
+    if (next != nullptr) {
+        set_flag(next, PREV_FREE_BIT, free);
+    }
+}
+
+std::size_t align_up(std::size_t value, std::size_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Размер блока, данных которого хватит на size байт
+std::size_t calc_block_size(std::size_t size)
+{
+    std::size_t full_size = align_up(size + sizeof(Node), ALIGNMENT);
+    return full_size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : full_size;
+}
+
+int floor_log2(std::size_t size)
+{
+    return 63 - __builtin_clzll(size);
+}
+
+// Класс, в который попадает блок размера size.
+void mapping_insert(std::size_t size, int* fl, int* sl)
+{
+    if (size < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = static_cast<int>(size >> ALIGNMENT_LOG2);
+        return;
+    }
+    int log2 = floor_log2(size);
+    *fl = log2 - FL_SHIFT + 1;
+    *sl = static_cast<int>(size >> (log2 - SL_LOG2)) - SL_COUNT;
+}
+
+// Класс, любой блок которого гарантированно вмещает size байт:
+// округляем size вверх до начала следующего класса.
+void mapping_search(std::size_t size, int* fl, int* sl)
+{
+    if (size >= SMALL_BLOCK_SIZE) {
+        size += (static_cast<std::size_t>(1) << (floor_log2(size) - SL_LOG2)) - 1;
+    }
+    mapping_insert(size, fl, sl);
+}
+
+void insert_into_class_list(Heap* heap, Node* node)
+{
+    int fl, sl;
+    mapping_insert(block_size(node), &fl, &sl);
+
+    FreeLinks* node_links = links(node);
+    node_links->prev_free = nullptr;
+    node_links->next_free = heap->free_lists[fl][sl];
+    if (heap->free_lists[fl][sl] != nullptr) {
+        links(heap->free_lists[fl][sl])->prev_free = node;
+    }
+    heap->free_lists[fl][sl] = node;
+
+    heap->fl_bitmap |= static_cast<std::uint64_t>(1) << fl;
+    heap->sl_bitmap[fl] |= 1u << sl;
+}
+
+void remove_from_class_list(Heap* heap, Node* node)
+{
+    int fl, sl;
+    mapping_insert(block_size(node), &fl, &sl);
+
+    FreeLinks* node_links = links(node);
+    if (node_links->next_free != nullptr) {
+        links(node_links->next_free)->prev_free = node_links->prev_free;
+    }
+    if (node_links->prev_free != nullptr) {
+        links(node_links->prev_free)->next_free = node_links->next_free;
+    } else {
+        heap->free_lists[fl][sl] = node_links->next_free;
+        if (heap->free_lists[fl][sl] == nullptr) {
+            heap->sl_bitmap[fl] &= ~(1u << sl);
+            if (heap->sl_bitmap[fl] == 0) {
+                heap->fl_bitmap &= ~(static_cast<std::uint64_t>(1) << fl);
+            }
+        }
+    }
+}
+
+TreeLinks* tree_links(Node* node)
+{
+    return reinterpret_cast<TreeLinks *>(node + 1);
+}
+
+// Ключ дерева - пара (размер, адрес), поэтому все ключи различны
+int compare_key(std::size_t size, Node* addr, Node* node)
+{
+    std::size_t node_size = block_size(node);
+    if (size != node_size) {
+        return size < node_size ? -1 : 1;
+    }
+    if (addr != node) {
+        return addr < node ? -1 : 1;
+    }
+    return 0;
+}
+
+// Top-down splay (Sleator, Tarjan): поднимает в корень узел с ключом
+// (size, addr) или последний узел на пути к нему. Родительские ссылки
+// не нужны, поэтому узел помещается в данные минимального свободного блока.
+Node* splay(Node* root, std::size_t size, Node* addr)
 {
-    if (curr->next == nullptr || !curr->next->is_empty) {
+    // Временный узел, к которому собираются левое и правое поддеревья
+    struct {
+        Node node;
+        TreeLinks links;
+    } assembly;
+    assembly.links.left = nullptr;
+    assembly.links.right = nullptr;
+
+    Node* left_max = &assembly.node;
+    Node* right_min = &assembly.node;
+    Node* curr = root;
+    for (;;) {
+        int cmp = compare_key(size, addr, curr);
+        if (cmp < 0) {
+            Node* child = tree_links(curr)->left;
+            if (child == nullptr) {
+                break;
+            }
+            if (compare_key(size, addr, child) < 0) {
+                // Поворот вправо
+                tree_links(curr)->left = tree_links(child)->right;
+                tree_links(child)->right = curr;
+                curr = child;
+                if (tree_links(curr)->left == nullptr) {
+                    break;
+                }
+            }
+            tree_links(right_min)->left = curr;
+            right_min = curr;
+            curr = tree_links(curr)->left;
+        } else if (cmp > 0) {
+            Node* child = tree_links(curr)->right;
+            if (child == nullptr) {
+                break;
+            }
+            if (compare_key(size, addr, child) > 0) {
+                // Поворот влево
+                tree_links(curr)->right = tree_links(child)->left;
+                tree_links(child)->left = curr;
+                curr = child;
+                if (tree_links(curr)->right == nullptr) {
+                    break;
+                }
+            }
+            tree_links(left_max)->right = curr;
+            left_max = curr;
+            curr = tree_links(curr)->right;
+        } else {
+            break;
+        }
+    }
+    tree_links(left_max)->right = tree_links(curr)->left;
+    tree_links(right_min)->left = tree_links(curr)->right;
+    tree_links(curr)->left = assembly.links.right;
+    tree_links(curr)->right = assembly.links.left;
+    return curr;
+}
+
+void insert_into_tree(Heap* heap, Node* node)
+{
+    TreeLinks* node_links = tree_links(node);
+    if (heap->free_tree == nullptr) {
+        node_links->left = nullptr;
+        node_links->right = nullptr;
+        heap->free_tree = node;
         return;
     }
 
-    curr->size += curr->next->size + sizeof(Node);
-    curr->next = curr->next->next;
-    if (curr->next != nullptr) {
-        curr->next->prev = curr;
+    Node* root = splay(heap->free_tree, block_size(node), node);
+    if (compare_key(block_size(node), node, root) < 0) {
+        node_links->left = tree_links(root)->left;
+        node_links->right = root;
+        tree_links(root)->left = nullptr;
+    } else {
+        node_links->right = tree_links(root)->right;
+        node_links->left = root;
+        tree_links(root)->right = nullptr;
+    }
+    heap->free_tree = node;
+}
+
+void remove_from_tree(Heap* heap, Node* node)
+{
+    // После splay узел в корне, его заменяет наибольший узел левого поддерева
+    Node* root = splay(heap->free_tree, block_size(node), node);
+    if (tree_links(root)->left == nullptr) {
+        heap->free_tree = tree_links(root)->right;
+        return;
     }
+    Node* new_root = splay(tree_links(root)->left, block_size(node), node);
+    tree_links(new_root)->right = tree_links(root)->right;
+    heap->free_tree = new_root;
+}
+
+void insert_free_node(Heap* heap, Node* node)
+{
+    heap->free_blocks++;
+    heap->free_bytes += block_size(node);
+    if (fit_policy == FitPolicy::BestFit) {
+        insert_into_tree(heap, node);
+    } else {
+        insert_into_class_list(heap, node);
+    }
+}
+
+void remove_free_node(Heap* heap, Node* node)
+{
+    heap->free_blocks--;
+    heap->free_bytes -= block_size(node);
+    if (fit_policy == FitPolicy::BestFit) {
+        remove_from_tree(heap, node);
+    } else {
+        remove_from_class_list(heap, node);
+    }
+}
+
+Node* find_first_fit(Heap* heap, std::size_t size)
+{
+    Node* curr = heap->head;
+    while (curr != nullptr) {
+        if (block_size(curr) >= size && is_free(curr)) {
+            break;
+        }
+        curr = next_node(heap, curr);
+    }
+    return curr;
+}
+
+// Как FirstFit, но поиск идет от next_fit_rover до конца буфера
+// и затем с начала. rover остается на найденном блоке: он будет
+// занят, и следующий поиск сразу перейдет к остатку после split
+Node* find_next_fit(Heap* heap, std::size_t size)
+{
+    Node* start = heap->next_fit_rover;
+    Node* curr = start;
+    do {
+        if (block_size(curr) >= size && is_free(curr)) {
+            heap->next_fit_rover = curr;
+            return curr;
+        }
+        curr = next_node(heap, curr);
+        if (curr == nullptr) {
+            curr = heap->head;
+        }
+    } while (curr != start);
+    return nullptr;
+}
+
+Node* find_best_fit(Heap* heap, std::size_t size)
+{
+    if (heap->free_tree == nullptr) {
+        return nullptr;
+    }
+
+    // Ищем наименьший ключ не меньше (size, nullptr): после splay в корне
+    // либо он сам, либо его предшественник, и тогда ответ - минимум справа
+    heap->free_tree = splay(heap->free_tree, size, nullptr);
+    if (block_size(heap->free_tree) >= size) {
+        return heap->free_tree;
+    }
+    Node* curr = tree_links(heap->free_tree)->right;
+    while (curr != nullptr && tree_links(curr)->left != nullptr) {
+        curr = tree_links(curr)->left;
+    }
+    return curr;
+}
+
+Node* find_segregated_fit(Heap* heap, std::size_t size)
+{
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+
+    if (fl < FL_COUNT) {
+        // Сначала ищем непустой класс не меньше sl в том же диапазоне,
+        // затем первый непустой диапазон выше
+        std::uint32_t sl_map = heap->sl_bitmap[fl] & (~0u << sl);
+        if (sl_map == 0) {
+            std::uint64_t fl_map = fl + 1 < 64 ? heap->fl_bitmap & (~static_cast<std::uint64_t>(0) << (fl + 1)) : 0;
+            if (fl_map != 0) {
+                fl = __builtin_ctzll(fl_map);
+                sl_map = heap->sl_bitmap[fl];
+            }
+        }
+        if (sl_map != 0) {
+            return heap->free_lists[fl][__builtin_ctz(sl_map)];
+        }
+    }
+
+    // Округление вверх могло пропустить подходящий блок из класса самого size
+    // (например, единственный большой блок сразу после mysetup) - проверяем
+    // голову этого списка, чтобы не терять MaxSize.
+    mapping_insert(size, &fl, &sl);
+    Node* candidate = heap->free_lists[fl][sl];
+    if (candidate != nullptr && block_size(candidate) >= size) {
+        return candidate;
+    }
+    return nullptr;
+}
+
+// Присоединяет к блоку curr следующий за ним блок, если тот свободен.
+// curr на момент вызова не должен лежать в списках свободных блоков.
+void join_node_with_next(Heap* heap, Node* curr)
+{
+    Node* next = next_node(heap, curr);
+    if (next == nullptr || !is_free(next)) {
+        return;
+    }
+
+    remove_free_node(heap, next);
+    set_block_size(curr, block_size(curr) + block_size(next));
+    if (heap->next_fit_rover == next) {
+        heap->next_fit_rover = curr;
+    }
+}
+
+// Отрезает от занятого блока curr хвост после первых size байт
+// и возвращает его как свободный блок, если хвост не меньше MIN_BLOCK_SIZE.
+void split_node(Heap* heap, Node* curr, std::size_t size)
+{
+    std::size_t curr_size = block_size(curr);
+    if (curr_size < size + MIN_BLOCK_SIZE) {
+        return;
+    }
+
+    // [block____________, next_____] -> [block_____, new_block_____, next_____]
+    Node* new_node = reinterpret_cast<Node *>(reinterpret_cast<std::uint8_t *>(curr) + size);
+    new_node->size_and_flags = curr_size - size;
+    set_block_size(curr, size);
+
+    // Хвост мог оказаться перед свободным блоком - сразу сливаем их
+    join_node_with_next(heap, new_node);
+    mark_block(heap, new_node, true);
+    insert_free_node(heap, new_node);
+}
+
+// Выбор политики поиска, вызывается до mysetup.
+void myset_fit_policy(FitPolicy policy)
+{
+    fit_policy = policy;
+}
+
+// Размечает buf как кучу heap из одного свободного блока
+void heap_setup(Heap* heap, void *buf, std::size_t size)
+{
+    // Сдвигаем начало так, чтобы данные каждого блока были выровнены на ALIGNMENT
+    std::uintptr_t buf_addr = reinterpret_cast<std::uintptr_t>(buf);
+    std::uintptr_t start = align_up(buf_addr + sizeof(Node), ALIGNMENT) - sizeof(Node);
+    std::size_t heap_size = (size - (start - buf_addr)) & ~(ALIGNMENT - 1);
+
+    heap->head = reinterpret_cast<Node *>(start);
+    heap->heap_end = reinterpret_cast<std::uint8_t *>(start) + heap_size;
+    heap->head->size_and_flags = heap_size;
+
+    heap->free_tree = nullptr;
+    heap->next_fit_rover = heap->head;
+    heap->free_bytes = 0;
+    heap->free_blocks = 0;
+    heap->fl_bitmap = 0;
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        heap->sl_bitmap[fl] = 0;
+        for (int sl = 0; sl < SL_COUNT; sl++) {
+            heap->free_lists[fl][sl] = nullptr;
+        }
+    }
+    mark_block(heap, heap->head, true);
+    insert_free_node(heap, heap->head);
 }
 
 // Эта функция будет вызвана перед тем как вызывать myalloc и myfree
@@ -35,84 +554,483 @@ void join_node_with_next(Node* curr)
 // size - размер участка памяти, на который указывает buf
 void mysetup(void *buf, std::size_t size)
 {
-    head = static_cast<Node *>(buf);
-    head->size = size - sizeof(Node);
-    head->is_empty = true;
-    head->next = nullptr;
-    head->prev = nullptr;
+    heap_setup(&main_heap, buf, size);
+    // Кеши потоков, наполненные из прошлого буфера, больше не действительны
+    heap_generation.fetch_add(1, std::memory_order_relaxed);
 }
 
-// Функция аллокации
-void *myalloc(std::size_t size)
+Node* find_free_node(Heap* heap, std::size_t size)
 {
-    Node* curr = head;
-    while (curr != nullptr) {
-        if (curr->size >= size && curr->is_empty) {
-            break;
-        }
-        curr = curr->next;
+    switch (fit_policy) {
+    case FitPolicy::NextFit:
+        return find_next_fit(heap, size);
+    case FitPolicy::SegregatedFit:
+        return find_segregated_fit(heap, size);
+    case FitPolicy::BestFit:
+        return find_best_fit(heap, size);
+    default:
+        return find_first_fit(heap, size);
     }
+}
 
+// Аллокация из кучи heap, общая для myalloc и арен myalloc_mt
+void *heap_alloc(Heap* heap, std::size_t size)
+{
+    std::size_t full_size = calc_block_size(size);
+
+    Node* curr = find_free_node(heap, full_size);
     if (curr == nullptr) {
         return NULL;
     }
 
-    // Размер текущего блока памяти больше, чем мы алоцируем + размер хедера, а значит есть место под новый блок
-    if (curr->size > size + sizeof(Node)) {
-        // Берем адрес начала текущего блока памяти и двигаем его на size байт
-        Node* new_node = reinterpret_cast<Node *>(reinterpret_cast<uint8_t *>(curr + 1) + size);
+    remove_free_node(heap, curr);
+    mark_block(heap, curr, false);
 
-        // Отделяем от текущего блока памяти новый свободный блок памяти
-        // [block____________, next_____] -> [block_____, new_block_____, next_____]
-        new_node->is_empty = true;
-        new_node->size = curr->size - sizeof(Node) - size;
-        new_node->next = curr->next;
-        new_node->prev = curr;
+    // Размер текущего блока памяти больше, чем мы алоцируем, а значит есть место под новый блок
+    split_node(heap, curr, full_size);
 
-        if (curr->next != nullptr) {
-            curr->next->prev = new_node;
-        }
+    // Отдаем указатель на начало данных
+    return curr + 1;
+}
 
-        curr->size = size;
-        curr->next = new_node;
+// Функция аллокации.
+// Возвращаемый адрес всегда выровнен на ALIGNMENT (16 байт): данные первого
+// блока выровнены в mysetup, а размеры всех блоков кратны ALIGNMENT.
+void *myalloc(std::size_t size)
+{
+    return heap_alloc(&main_heap, size);
+}
+
+// Аллокация с выравниванием данных на alignment (степень двойки).
+// Отступ перед выровненным адресом не теряется, а становится отдельным
+// свободным блоком, поэтому блок берется с запасом alignment + MIN_BLOCK_SIZE.
+// Освобождается обычным myfree.
+void *myalloc_aligned(std::size_t size, std::size_t alignment)
+{
+    Heap* heap = &main_heap;
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT) {
+        return myalloc(size);
     }
 
-    // Занимаем текущий блок памяти и отдаем указатель на начало данных
-    curr->is_empty = false;
+    std::size_t full_size = calc_block_size(size);
+    Node* curr = find_free_node(heap, full_size + alignment + MIN_BLOCK_SIZE);
+    if (curr == nullptr) {
+        return NULL;
+    }
+    remove_free_node(heap, curr);
+
+    std::uintptr_t curr_addr = reinterpret_cast<std::uintptr_t>(curr);
+    std::uintptr_t data_addr = align_up(curr_addr + sizeof(Node), alignment);
+    std::size_t padding = data_addr - sizeof(Node) - curr_addr;
+    if (padding != 0 && padding < MIN_BLOCK_SIZE) {
+        // Отступ слишком мал для свободного блока - берем следующий выровненный адрес
+        padding += alignment;
+    }
+
+    if (padding != 0) {
+        // [padding__, aligned_block__________] - отступ остается в куче свободным блоком
+        Node* aligned = reinterpret_cast<Node *>(curr_addr + padding);
+        aligned->size_and_flags = block_size(curr) - padding;
+        set_block_size(curr, padding);
+        mark_block(heap, curr, true);
+        insert_free_node(heap, curr);
+        curr = aligned;
+    }
+
+    mark_block(heap, curr, false);
+    split_node(heap, curr, full_size);
     return curr + 1;
 }
 
-// Функция освобождения
-void myfree(void *p)
+// Освобождение в кучу heap, общее для myfree и арен myfree_mt
+void heap_free(Heap* heap, void *p)
 {
-    Node* curr = head;
-    while (curr != nullptr && static_cast<void*>(curr + 1) != p) {
-        curr = curr->next;
-    }
-    
-    // Не нашли такой блок
-    if (curr == nullptr) {
+    std::uint8_t* addr = static_cast<std::uint8_t *>(p);
+    if (addr == nullptr || addr <= reinterpret_cast<std::uint8_t *>(heap->head) || addr >= heap->heap_end) {
         return;
     }
 
-    curr->is_empty = true;
+    // Заголовок лежит прямо перед данными
+    Node* curr = static_cast<Node *>(p) - 1;
 
     // Соединяем текущий блок памяти со следующим, если он пустой
-    join_node_with_next(curr);
-    if (curr->prev != nullptr && curr->prev->is_empty) {
+    join_node_with_next(heap, curr);
+
+    Node* prev = prev_free_node(curr);
+    if (prev != nullptr) {
         // Соединяем предыдущий блок памяти с текущим, если он пустой
-        join_node_with_next(curr->prev);
+        remove_free_node(heap, prev);
+        set_block_size(prev, block_size(prev) + block_size(curr));
+        if (heap->next_fit_rover == curr) {
+            heap->next_fit_rover = prev;
+        }
+        curr = prev;
+    }
+
+    mark_block(heap, curr, true);
+    insert_free_node(heap, curr);
+}
+
+// Функция освобождения
+void myfree(void *p)
+{
+    heap_free(&main_heap, p);
+}
+
+// Наибольший свободный блок: правый край дерева для BestFit, иначе
+// самый длинный блок в старшем непустом размерном классе
+std::size_t largest_free_block(Heap* heap)
+{
+    Node* largest = nullptr;
+    if (fit_policy == FitPolicy::BestFit) {
+        for (Node* curr = heap->free_tree; curr != nullptr; curr = tree_links(curr)->right) {
+            largest = curr;
+        }
+    } else if (heap->fl_bitmap != 0) {
+        int fl = floor_log2(heap->fl_bitmap);
+        int sl = 31 - __builtin_clz(heap->sl_bitmap[fl]);
+        for (Node* curr = heap->free_lists[fl][sl]; curr != nullptr; curr = links(curr)->next_free) {
+            if (largest == nullptr || block_size(curr) > block_size(largest)) {
+                largest = curr;
+            }
+        }
+    }
+    return largest == nullptr ? 0 : block_size(largest);
+}
+
+HeapStats myheap_stats()
+{
+    Heap* heap = &main_heap;
+    HeapStats stats;
+    stats.free_bytes = heap->free_bytes;
+    stats.free_blocks = heap->free_blocks;
+    stats.largest_free_block = largest_free_block(heap);
+    stats.external_fragmentation = heap->free_bytes == 0
+        ? 0.0
+        : 1.0 - static_cast<double>(stats.largest_free_block) / heap->free_bytes;
+    return stats;
+}
+
+// Статистика myrealloc: сколько раз удалось обойтись без переноса
+// и сколько байт пришлось скопировать или удалось не копировать
+struct ReallocStats {
+    std::size_t in_place;
+    std::size_t moved;
+    std::size_t copied_bytes;
+    std::size_t saved_bytes;
+};
+
+ReallocStats realloc_stats;
+
+// Изменяет размер блока p на size байт, сохраняя данные.
+// Уменьшение отрезает хвост блока, увеличение сначала пробует
+// поглотить свободный следующий блок, и только если это невозможно,
+// выделяет новый блок и копирует данные.
+void *myrealloc(void *p, std::size_t size)
+{
+    if (p == nullptr) {
+        return myalloc(size);
+    }
+    if (size == 0) {
+        myfree(p);
+        return NULL;
     }
+
+    Heap* heap = &main_heap;
+    Node* curr = static_cast<Node *>(p) - 1;
+    std::size_t full_size = calc_block_size(size);
+    std::size_t data_size = block_size(curr) - sizeof(Node);
+
+    Node* next = next_node(heap, curr);
+    bool can_grow = next != nullptr && is_free(next) && block_size(curr) + block_size(next) >= full_size;
+    if (full_size <= block_size(curr) || can_grow) {
+        if (full_size > block_size(curr)) {
+            // Поглощаем следующий свободный блок, у блока за ним больше нет свободного соседа
+            join_node_with_next(heap, curr);
+            mark_block(heap, curr, false);
+        }
+        split_node(heap, curr, full_size);
+        realloc_stats.in_place++;
+        realloc_stats.saved_bytes += data_size < size ? data_size : size;
+        return p;
+    }
+
+    void* new_p = myalloc(size);
+    if (new_p == nullptr) {
+        return NULL;
+    }
+    std::memcpy(new_p, p, data_size);
+    myfree(p);
+    realloc_stats.moved++;
+    realloc_stats.copied_bytes += data_size;
+    return new_p;
 }
 
 std::size_t get_size(void *p) {
     if (p == nullptr) {
         return 0;
     }
-    Node* node = static_cast<Node *>(p);
-    return (node - 1)->size;
+    Node* node = static_cast<Node *>(p) - 1;
+    return block_size(node) - sizeof(Node);
+}
+
+// Многопоточный режим: mysetup_mt делит буфер на несколько куч (арен)
+// со своими mutex-ами, после чего myalloc_mt/myfree_mt можно вызывать из
+// разных потоков. С однопоточными myalloc/myfree он не смешивается.
+//
+// Маленькие блоки (до TCACHE_MAX_BLOCK) обслуживаются из кеша потока без
+// блокировок: кеш пополняется из арены и возвращает в нее блоки пачками
+// по TCACHE_BATCH, так что mutex арены берется один раз на пачку.
+// Большие запросы идут прямо в арену. Каждый поток при первом обращении
+// получает свою домашнюю арену по кругу, поэтому потоки на разных аренах
+// не делят блокировку; если домашняя арена занята или в ней нет места,
+// пробуются остальные (как арены в glibc). Освобождаемый блок
+// возвращается в арену, в которую попадает его адрес.
+// Блоки в кешах с точки зрения кучи заняты, поэтому перед проверкой
+// дефрагментации нужно вызвать myflush_thread_cache. При выходе потока
+// кеш возвращается в арены сам, если буфер еще тот же; перед тем как
+// отдать буфер, нужно вызвать myteardown_mt, чтобы кеши потоков,
+// которые завершатся позже, его уже не трогали.
+
+const std::size_t TCACHE_MAX_BLOCK = 512;
+const int TCACHE_CLASSES = static_cast<int>((TCACHE_MAX_BLOCK - MIN_BLOCK_SIZE) / ALIGNMENT) + 1;
+const std::size_t TCACHE_BATCH = 16;
+const std::size_t TCACHE_LIMIT = TCACHE_BATCH * 2;
+
+const int MT_MAX_ARENAS = 8;
+const std::size_t MT_MIN_ARENA_SIZE = 64 * 1024;
+
+struct alignas(64) MtArena {
+    std::mutex lock;
+    Heap heap;
+};
+
+MtArena mt_arenas[MT_MAX_ARENAS];
+int mt_arenas_count;
+std::uint8_t* mt_base;
+std::size_t mt_arena_size;
+std::atomic<unsigned> mt_next_arena(0);
+
+// Свободный блок в кеше потока, ссылка лежит в его данных
+struct CachedBlock {
+    CachedBlock *next;
+};
+
+struct ThreadCache {
+    CachedBlock *lists[TCACHE_CLASSES];
+    std::size_t counts[TCACHE_CLASSES];
+    std::uint64_t generation;
+    int arena; // домашняя арена потока
+
+    ~ThreadCache();
+};
+
+thread_local ThreadCache thread_cache;
+
+// Делит буфер на arenas арен (но каждая не меньше MT_MIN_ARENA_SIZE).
+// Одна арена - это прежняя схема с общим mutex-ом.
+void mysetup_mt(void *buf, std::size_t size, int arenas = MT_MAX_ARENAS)
+{
+    std::size_t max_arenas = size / MT_MIN_ARENA_SIZE;
+    if (arenas > MT_MAX_ARENAS) {
+        arenas = MT_MAX_ARENAS;
+    }
+    if (static_cast<std::size_t>(arenas) > max_arenas) {
+        arenas = max_arenas == 0 ? 1 : static_cast<int>(max_arenas);
+    }
+    mt_arenas_count = arenas < 1 ? 1 : arenas;
+    mt_base = static_cast<std::uint8_t *>(buf);
+    mt_arena_size = size / mt_arenas_count;
+    for (int i = 0; i < mt_arenas_count; i++) {
+        std::size_t arena_size = i + 1 < mt_arenas_count ? mt_arena_size : size - i * mt_arena_size;
+        heap_setup(&mt_arenas[i].heap, mt_base + i * mt_arena_size, arena_size);
+    }
+    heap_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Завершает многопоточный режим перед тем, как буфер будет отдан.
+// Вызывается, когда остальные потоки уже не обращаются к myalloc_mt/myfree_mt.
+void myteardown_mt()
+{
+    mt_arenas_count = 0;
+    heap_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+MtArena* arena_of(void *p)
+{
+    std::size_t index = (static_cast<std::uint8_t *>(p) - mt_base) / mt_arena_size;
+    return &mt_arenas[index < static_cast<std::size_t>(mt_arenas_count) ? index : mt_arenas_count - 1];
+}
+
+int tcache_class(std::size_t full_size)
+{
+    return static_cast<int>((full_size - MIN_BLOCK_SIZE) / ALIGNMENT);
+}
+
+// Сбрасывает кеш потока, если он наполнен из предыдущего буфера.
+// Вызывается только после mysetup_mt, когда есть хотя бы одна арена.
+ThreadCache* get_thread_cache()
+{
+    ThreadCache* cache = &thread_cache;
+    std::uint64_t generation = heap_generation.load(std::memory_order_relaxed);
+    if (cache->generation != generation) {
+        for (int i = 0; i < TCACHE_CLASSES; i++) {
+            cache->lists[i] = nullptr;
+            cache->counts[i] = 0;
+        }
+        cache->generation = generation;
+        cache->arena = static_cast<int>(mt_next_arena.fetch_add(1, std::memory_order_relaxed) % mt_arenas_count);
+    }
+    return cache;
+}
+
+// Аллокация из арен, начиная с домашней: сначала только из свободных
+// арен, и лишь если все заняты или без места - с ожиданием блокировки
+void *arenas_alloc(int home, std::size_t size)
+{
+    for (int i = 0; i < mt_arenas_count; i++) {
+        MtArena* arena = &mt_arenas[(home + i) % mt_arenas_count];
+        std::unique_lock<std::mutex> guard(arena->lock, std::try_to_lock);
+        if (guard.owns_lock()) {
+            void* p = heap_alloc(&arena->heap, size);
+            if (p != nullptr) {
+                return p;
+            }
+        }
+    }
+    for (int i = 0; i < mt_arenas_count; i++) {
+        MtArena* arena = &mt_arenas[(home + i) % mt_arenas_count];
+        std::lock_guard<std::mutex> guard(arena->lock);
+        void* p = heap_alloc(&arena->heap, size);
+        if (p != nullptr) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Возвращает в кучу n блоков из головы списка. Блоки могли прийти из
+// разных арен (их освободил не тот поток, что аллоцировал), поэтому
+// блокировка меняется, только когда меняется арена.
+void release_cached_blocks(CachedBlock** list, std::size_t* count, std::size_t n)
+{
+    MtArena* locked = nullptr;
+    for (std::size_t i = 0; i < n && *list != nullptr; i++) {
+        CachedBlock* block = *list;
+        MtArena* arena = arena_of(block);
+        if (arena != locked) {
+            if (locked != nullptr) {
+                locked->lock.unlock();
+            }
+            arena->lock.lock();
+            locked = arena;
+        }
+        *list = block->next;
+        (*count)--;
+        heap_free(&arena->heap, block);
+    }
+    if (locked != nullptr) {
+        locked->lock.unlock();
+    }
+}
+
+void *myalloc_mt(std::size_t size)
+{
+    if (mt_arenas_count == 0) {
+        // mysetup_mt не вызывался (или уже был myteardown_mt)
+        return NULL;
+    }
+    ThreadCache* cache = get_thread_cache();
+    std::size_t full_size = calc_block_size(size);
+    if (full_size > TCACHE_MAX_BLOCK) {
+        return arenas_alloc(cache->arena, size);
+    }
+
+    int cls = tcache_class(full_size);
+    if (cache->lists[cls] == nullptr) {
+        // Пополняем класс пачкой блоков из домашней арены за один захват блокировки
+        MtArena* arena = &mt_arenas[cache->arena];
+        std::lock_guard<std::mutex> guard(arena->lock);
+        for (std::size_t i = 0; i < TCACHE_BATCH; i++) {
+            CachedBlock* block = static_cast<CachedBlock *>(heap_alloc(&arena->heap, full_size - sizeof(Node)));
+            if (block == nullptr) {
+                break;
+            }
+            block->next = cache->lists[cls];
+            cache->lists[cls] = block;
+            cache->counts[cls]++;
+        }
+    }
+    if (cache->lists[cls] == nullptr) {
+        // Домашняя арена кончилась - берем один блок из любой
+        return arenas_alloc(cache->arena, full_size - sizeof(Node));
+    }
+
+    CachedBlock* block = cache->lists[cls];
+    cache->lists[cls] = block->next;
+    cache->counts[cls]--;
+    return block;
+}
+
+void myfree_mt(void *p)
+{
+    if (p == nullptr || mt_arenas_count == 0) {
+        return;
+    }
+
+    Node* node = static_cast<Node *>(p) - 1;
+    std::size_t full_size = __atomic_load_n(&node->size_and_flags, __ATOMIC_RELAXED) & ~FLAGS_MASK;
+    if (full_size > TCACHE_MAX_BLOCK) {
+        MtArena* arena = arena_of(p);
+        std::lock_guard<std::mutex> guard(arena->lock);
+        heap_free(&arena->heap, p);
+        return;
+    }
+
+    // Блок мог оказаться больше запрошенного (хвост не отрезается, если он
+    // меньше MIN_BLOCK_SIZE), поэтому класс считаем по его реальному размеру
+    ThreadCache* cache = get_thread_cache();
+    int cls = tcache_class(full_size);
+    CachedBlock* block = static_cast<CachedBlock *>(p);
+    block->next = cache->lists[cls];
+    cache->lists[cls] = block;
+    cache->counts[cls]++;
+
+    if (cache->counts[cls] > TCACHE_LIMIT) {
+        release_cached_blocks(&cache->lists[cls], &cache->counts[cls], TCACHE_BATCH);
+    }
+}
+
+// Возвращает в кучу все блоки из кеша текущего потока
+void myflush_thread_cache()
+{
+    if (mt_arenas_count == 0) {
+        return;
+    }
+    ThreadCache* cache = get_thread_cache();
+    for (int i = 0; i < TCACHE_CLASSES; i++) {
+        release_cached_blocks(&cache->lists[i], &cache->counts[i], cache->counts[i]);
+    }
+}
+
+// При выходе потока кеш возвращается в арены, только если он наполнен
+// из текущего буфера: после myteardown_mt или нового mysetup поколение
+// другое, и блоки старого буфера просто забываются.
+ThreadCache::~ThreadCache()
+{
+    if (mt_arenas_count == 0 || generation != heap_generation.load(std::memory_order_relaxed)) {
+        return;
+    }
+    for (int i = 0; i < TCACHE_CLASSES; i++) {
+        release_cached_blocks(&lists[i], &counts[i], counts[i]);
+    }
 }
 
+// Демонстрационный main, бенчмарк alloc_bench подключает файл без него
+#ifndef ALLOC_BENCH
 int main(int argc, char const *argv[])
 {
     std::size_t size = 1024;
@@ -164,3 +1082,4 @@ int main(int argc, char const *argv[])
 
     return 0;
 }
+#endif
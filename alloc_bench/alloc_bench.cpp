@@ -0,0 +1,948 @@
+// Бенчмарк аллокаторов: проигрывает синтетические или записанные в файл
+// трассы malloc/free на alloc_v1, alloc_v2 и slab_alloc.
+//
+// Сборка (из корня репозитория):
+//   g++ -O2 -std=c++17 alloc_bench/alloc_bench.cpp -o alloc_bench -lpthread
+//
+// Аллокаторы подключаются как исходники в отдельные namespace-ы, чтобы их
+// одноименные функции не конфликтовали. Все стандартные заголовки, которые
+// они используют, должны быть подключены здесь заранее - тогда повторные
+// #include внутри namespace ничего не делают.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define ALLOC_BENCH
+namespace v1 {
+#include "../alloc/alloc_v1.cpp"
+}
+namespace v2 {
+#include "../alloc/alloc_v2.cpp"
+}
+namespace slab {
+#include "../slab_alloc/slab_alloc.cpp"
+}
+
+// Операция трассы: 'a' - выделить size байт под объект id, 'f' - освободить объект id
+struct TraceOp {
+    char type;
+    std::size_t id;
+    std::size_t size;
+};
+
+struct Trace {
+    std::string name;
+    std::vector<TraceOp> ops;
+    std::size_t objects_count;
+};
+
+const std::size_t MIN_ALLOC_SIZE = 16;
+
+// Генератор трассы: следит за суммарным размером живых объектов, чтобы трасса
+// помещалась в буфер, и в конце освобождает все, что осталось.
+// Порядок освобождения выбирают сами генераторы.
+class TraceBuilder
+{
+public:
+    TraceBuilder(const std::string& name, std::size_t max_live_bytes, unsigned seed)
+        : max_live_bytes_(max_live_bytes), live_bytes_(0), rng_(seed)
+    {
+        trace_.name = name;
+        trace_.objects_count = 0;
+    }
+
+    bool can_alloc(std::size_t size) const { return live_bytes_ + size <= max_live_bytes_; }
+    std::mt19937& rng() { return rng_; }
+
+    std::size_t alloc(std::size_t size)
+    {
+        std::size_t id = trace_.objects_count++;
+        trace_.ops.push_back({'a', id, size});
+        sizes_.push_back(size);
+        live_bytes_ += size;
+        return id;
+    }
+
+    void free(std::size_t id)
+    {
+        trace_.ops.push_back({'f', id, 0});
+        live_bytes_ -= sizes_[id];
+        sizes_[id] = 0;
+    }
+
+    Trace finish()
+    {
+        for (std::size_t id = 0; id < sizes_.size(); id++) {
+            if (sizes_[id] != 0) {
+                free(id);
+            }
+        }
+        return trace_;
+    }
+
+private:
+    Trace trace_;
+    std::vector<std::size_t> sizes_;
+    std::size_t max_live_bytes_;
+    std::size_t live_bytes_;
+    std::mt19937 rng_;
+};
+
+// Освобождает случайный объект из pool
+void free_random(TraceBuilder* builder, std::vector<std::size_t>* pool)
+{
+    std::size_t index = builder->rng()() % pool->size();
+    builder->free((*pool)[index]);
+    (*pool)[index] = pool->back();
+    pool->pop_back();
+}
+
+// Выделения и освобождения случайных объектов вперемешку с размерами из next_size
+template <typename SizeGenerator>
+Trace random_trace(const std::string& name, unsigned seed, std::size_t ops, std::size_t max_live_bytes, SizeGenerator next_size)
+{
+    TraceBuilder builder(name, max_live_bytes, seed);
+    std::vector<std::size_t> live;
+    for (std::size_t i = 0; i < ops; i++) {
+        std::size_t size = next_size(builder.rng());
+        if (!live.empty() && (builder.rng()() % 2 == 0 || !builder.can_alloc(size))) {
+            free_random(&builder, &live);
+        } else {
+            live.push_back(builder.alloc(size));
+        }
+    }
+    return builder.finish();
+}
+
+// Равномерные размеры от 16 до 512 байт
+Trace uniform_trace(std::size_t ops, std::size_t max_live_bytes)
+{
+    std::uniform_int_distribution<std::size_t> sizes(MIN_ALLOC_SIZE, 512);
+    return random_trace("uniform", 1, ops, max_live_bytes, [&](std::mt19937& rng) { return sizes(rng); });
+}
+
+// Размеры по степенному закону (Парето): в основном мелкие объекты и редкие большие
+Trace power_law_trace(std::size_t ops, std::size_t max_live_bytes)
+{
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    const double alpha = 1.2;
+    const std::size_t max_size = 64 * 1024;
+    return random_trace("power-law", 2, ops, max_live_bytes, [&](std::mt19937& rng) {
+        double scale = std::pow(1.0 - uniform(rng), -1.0 / alpha);
+        return std::min(max_size, static_cast<std::size_t>(MIN_ALLOC_SIZE * scale));
+    });
+}
+
+// Производитель выделяет пачку сообщений, потребитель освобождает их в порядке FIFO
+Trace producer_consumer_trace(std::size_t ops, std::size_t max_live_bytes)
+{
+    TraceBuilder builder("producer-consumer", max_live_bytes, 3);
+    std::uniform_int_distribution<std::size_t> sizes(64, 2048);
+    std::deque<std::size_t> queue;
+    std::size_t done = 0;
+    while (done < ops) {
+        std::size_t produce = 1 + builder.rng()() % 64;
+        for (std::size_t i = 0; i < produce && done < ops; i++, done++) {
+            std::size_t size = sizes(builder.rng());
+            if (!builder.can_alloc(size)) {
+                break;
+            }
+            queue.push_back(builder.alloc(size));
+        }
+        std::size_t consume = 1 + builder.rng()() % 64;
+        for (std::size_t i = 0; i < consume && !queue.empty() && done < ops; i++, done++) {
+            builder.free(queue.front());
+            queue.pop_front();
+        }
+    }
+    return builder.finish();
+}
+
+// Долгоживущие объекты занимают треть буфера до конца трассы,
+// а вокруг них постоянно выделяются и освобождаются короткоживущие
+Trace long_lived_churn_trace(std::size_t ops, std::size_t max_live_bytes)
+{
+    TraceBuilder builder("long-lived+churn", max_live_bytes, 4);
+    std::uniform_int_distribution<std::size_t> long_sizes(32, 4096);
+    std::uniform_int_distribution<std::size_t> churn_sizes(MIN_ALLOC_SIZE, 256);
+
+    std::size_t long_lived_bytes = 0;
+    std::size_t done = 0;
+    for (; long_lived_bytes < max_live_bytes / 3 && done < ops; done++) {
+        std::size_t size = long_sizes(builder.rng());
+        builder.alloc(size);
+        long_lived_bytes += size;
+    }
+
+    std::vector<std::size_t> churn;
+    for (; done < ops; done++) {
+        std::size_t size = churn_sizes(builder.rng());
+        if (!churn.empty() && (builder.rng()() % 2 == 0 || !builder.can_alloc(size))) {
+            free_random(&builder, &churn);
+        } else {
+            churn.push_back(builder.alloc(size));
+        }
+    }
+    return builder.finish();
+}
+
+// Формат файла: по операции на строку, "a <id> <size>" или "f <id>"
+bool load_trace(const char* path, Trace* trace)
+{
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    trace->name = path;
+    trace->objects_count = 0;
+    std::string type;
+    while (file >> type) {
+        TraceOp op = {type[0], 0, 0};
+        file >> op.id;
+        if (op.type == 'a') {
+            file >> op.size;
+        }
+        trace->ops.push_back(op);
+        trace->objects_count = std::max(trace->objects_count, op.id + 1);
+    }
+    return true;
+}
+
+void save_trace(const Trace& trace, const std::string& path)
+{
+    std::ofstream file(path);
+    for (const TraceOp& op : trace.ops) {
+        if (op.type == 'a') {
+            file << "a " << op.id << " " << op.size << "\n";
+        } else {
+            file << "f " << op.id << "\n";
+        }
+    }
+}
+
+// Внешняя фрагментация по списку свободных участков: 1 - largest / total
+struct FreeSpace {
+    std::size_t largest;
+    std::size_t total;
+
+    void add(std::size_t size)
+    {
+        largest = std::max(largest, size);
+        total += size;
+    }
+
+    double fragmentation() const { return total == 0 ? 0.0 : 1.0 - static_cast<double>(largest) / total; }
+};
+
+double v1_markers_fragmentation(std::size_t)
+{
+    FreeSpace space = {0, 0};
+    for (void* block = v1::my_buf; v1::is_in_buf(block); block = v1::next_block(block)) {
+        if (v1::is_empty(block)) {
+            space.add(v1::get_size(block));
+        }
+    }
+    return space.fragmentation();
+}
+
+double v1_bitmap_fragmentation(std::size_t)
+{
+    FreeSpace space = {0, 0};
+    std::size_t run = 0;
+    for (std::size_t granule = 0; granule < v1::granules_count; granule++) {
+        bool allocated = (v1::alloc_bits[granule / v1::WORD_BITS] >> (granule % v1::WORD_BITS)) & 1;
+        if (allocated) {
+            if (run != 0) {
+                space.add(run * v1::GRANULE_SIZE);
+            }
+            run = 0;
+        } else {
+            run++;
+        }
+    }
+    if (run != 0) {
+        space.add(run * v1::GRANULE_SIZE);
+    }
+    return space.fragmentation();
+}
+
+double v2_fragmentation(std::size_t)
+{
+    return v2::myheap_stats().external_fragmentation;
+}
+
+// slab_alloc проигрывает трассы через kmalloc/kfree: лестница кешей
+// до 4Kb, большие запросы идут в alloc_slab целиком
+void slab_setup(void*, std::size_t)
+{
+    slab::kmalloc_setup();
+}
+
+void* slab_alloc_object(std::size_t size)
+{
+    return slab::kmalloc(size);
+}
+
+void slab_free_object(void* p, std::size_t)
+{
+    slab::kfree(p);
+}
+
+void slab_release()
+{
+    slab::kmalloc_release();
+}
+
+std::size_t count_slabs(slab::slab_header* slab)
+{
+    std::size_t count = 0;
+    for (; slab != nullptr; slab = slab->next) {
+        count++;
+    }
+    return count;
+}
+
+// Для кешей считаем внутреннюю фрагментацию: доля памяти SLAB-ов, не занятая данными
+double slab_fragmentation(std::size_t live_bytes)
+{
+    std::size_t slab_bytes = slab::kmalloc_large_bytes;
+    for (int cls = 0; cls < slab::KMALLOC_CLASSES; cls++) {
+        slab::cache* cache = &slab::kmalloc_caches[cls];
+        std::size_t slabs = count_slabs(cache->empty_slabs) + count_slabs(cache->active_slabs) + count_slabs(cache->full_slabs);
+        slab_bytes += slabs * cache->slab_size;
+    }
+    return slab_bytes == 0 ? 0.0 : 1.0 - static_cast<double>(live_bytes) / slab_bytes;
+}
+
+struct Allocator {
+    const char* name;
+    // Аллокатор распределяет переданный буфер, для него имеют смысл MaxSize и EffectiveSize
+    bool uses_buffer;
+    void (*setup)(void* buf, std::size_t size);
+    void* (*alloc)(std::size_t size);
+    void (*free)(void* p, std::size_t size);
+    double (*fragmentation)(std::size_t live_bytes);
+    void (*release)();
+};
+
+void no_release() {}
+
+std::vector<Allocator> make_allocators()
+{
+    return {
+        {"v1 byte markers", true,
+         [](void* buf, std::size_t size) { v1::myset_engine(v1::Engine::ByteMarkers); v1::mysetup(buf, size); },
+         v1::myalloc, [](void* p, std::size_t) { v1::myfree(p); }, v1_markers_fragmentation, no_release},
+        {"v1 bitmap", true,
+         [](void* buf, std::size_t size) { v1::myset_engine(v1::Engine::Bitmap); v1::mysetup(buf, size); },
+         v1::myalloc, [](void* p, std::size_t) { v1::myfree(p); }, v1_bitmap_fragmentation, no_release},
+        {"v2 first fit", true,
+         [](void* buf, std::size_t size) { v2::myset_fit_policy(v2::FitPolicy::FirstFit); v2::mysetup(buf, size); },
+         v2::myalloc, [](void* p, std::size_t) { v2::myfree(p); }, v2_fragmentation, no_release},
+        {"v2 next fit", true,
+         [](void* buf, std::size_t size) { v2::myset_fit_policy(v2::FitPolicy::NextFit); v2::mysetup(buf, size); },
+         v2::myalloc, [](void* p, std::size_t) { v2::myfree(p); }, v2_fragmentation, no_release},
+        {"v2 segregated fit", true,
+         [](void* buf, std::size_t size) { v2::myset_fit_policy(v2::FitPolicy::SegregatedFit); v2::mysetup(buf, size); },
+         v2::myalloc, [](void* p, std::size_t) { v2::myfree(p); }, v2_fragmentation, no_release},
+        {"v2 best fit", true,
+         [](void* buf, std::size_t size) { v2::myset_fit_policy(v2::FitPolicy::BestFit); v2::mysetup(buf, size); },
+         v2::myalloc, [](void* p, std::size_t) { v2::myfree(p); }, v2_fragmentation, no_release},
+        {"slab kmalloc", false, slab_setup, slab_alloc_object, slab_free_object, slab_fragmentation, slab_release},
+    };
+}
+
+// Счетчик промахов кеша через perf_event, если он доступен
+class CacheMissCounter
+{
+public:
+    CacheMissCounter() : fd_(-1)
+    {
+#ifdef __linux__
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~CacheMissCounter()
+    {
+#ifdef __linux__
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+#endif
+    }
+
+    bool available() const { return fd_ >= 0; }
+
+    void start()
+    {
+#ifdef __linux__
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    long long stop()
+    {
+        long long count = -1;
+#ifdef __linux__
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+                count = -1;
+            }
+        }
+#endif
+        return count;
+    }
+
+private:
+    int fd_;
+};
+
+std::uint32_t percentile(std::vector<std::uint32_t>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    std::size_t index = static_cast<std::size_t>(p * (sorted.size() - 1));
+    return sorted[index];
+}
+
+// Время каждой операции меряется отдельно, поэтому в ns/op входят
+// накладные расходы steady_clock (десятки наносекунд)
+void replay(const Trace& trace, const Allocator& allocator, void* buf, std::size_t buf_size)
+{
+    std::vector<void*> objects(trace.objects_count, nullptr);
+    std::vector<std::size_t> sizes(trace.objects_count, 0);
+    std::vector<std::uint32_t> alloc_ns;
+    std::vector<std::uint32_t> free_ns;
+    alloc_ns.reserve(trace.ops.size());
+    free_ns.reserve(trace.ops.size());
+
+    const std::size_t sample_period = 256;
+    std::size_t live_bytes = 0;
+    std::size_t peak_live_bytes = 0;
+    std::size_t failures = 0;
+    double peak_fragmentation = 0.0;
+
+    allocator.setup(buf, buf_size);
+    CacheMissCounter misses;
+    misses.start();
+    for (std::size_t i = 0; i < trace.ops.size(); i++) {
+        const TraceOp& op = trace.ops[i];
+        if (op.type == 'a') {
+            auto start = std::chrono::steady_clock::now();
+            void* p = allocator.alloc(op.size);
+            auto end = std::chrono::steady_clock::now();
+            alloc_ns.push_back(static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+            if (p == nullptr) {
+                failures++;
+                continue;
+            }
+            objects[op.id] = p;
+            sizes[op.id] = op.size;
+            live_bytes += op.size;
+        } else if (objects[op.id] != nullptr) {
+            auto start = std::chrono::steady_clock::now();
+            allocator.free(objects[op.id], sizes[op.id]);
+            auto end = std::chrono::steady_clock::now();
+            free_ns.push_back(static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+            objects[op.id] = nullptr;
+            live_bytes -= sizes[op.id];
+        }
+        // Фрагментацию меряем только под нагрузкой: пока аллокатор прогревается
+        // в начале трассы или освобождает все в конце, живых объектов мало,
+        // и доля пустого места в SLAB-ах ничего не говорит
+        peak_live_bytes = std::max(peak_live_bytes, live_bytes);
+        bool loaded = i >= trace.ops.size() / 10 && live_bytes * 2 >= peak_live_bytes;
+        if (i % sample_period == 0 && loaded) {
+            misses.stop();
+            peak_fragmentation = std::max(peak_fragmentation, allocator.fragmentation(live_bytes));
+            misses.start();
+        }
+    }
+    long long cache_misses = misses.stop();
+    allocator.release();
+
+    std::sort(alloc_ns.begin(), alloc_ns.end());
+    std::sort(free_ns.begin(), free_ns.end());
+    std::printf("  %-18s alloc p50/p99/p99.9 %5u/%6u/%7u ns  free p50/p99 %5u/%6u ns  fails %6zu  peak frag %5.3f  cache misses ",
+                allocator.name,
+                percentile(alloc_ns, 0.5), percentile(alloc_ns, 0.99), percentile(alloc_ns, 0.999),
+                percentile(free_ns, 0.5), percentile(free_ns, 0.99),
+                failures, peak_fragmentation);
+    if (cache_misses >= 0) {
+        std::printf("%lld\n", cache_misses);
+    } else {
+        std::printf("n/a\n");
+    }
+}
+
+// MaxSize - наибольший блок, который удается выделить сразу после setup
+std::size_t find_max_size(const Allocator& allocator, void* buf, std::size_t buf_size)
+{
+    std::size_t low = 0;
+    std::size_t high = buf_size;
+    while (low < high) {
+        std::size_t mid = low + (high - low + 1) / 2;
+        allocator.setup(buf, buf_size);
+        if (allocator.alloc(mid) != nullptr) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+// EffectiveSize - сколько памяти удается раздать блоками минимального размера.
+// Заодно проверяем защиту от фрагментации: после освобождения всего
+// та же последовательность аллокаций должна снова пройти.
+std::size_t find_effective_size(const Allocator& allocator, void* buf, std::size_t buf_size, bool* defragmented)
+{
+    allocator.setup(buf, buf_size);
+    std::vector<void*> blocks;
+    for (void* p = allocator.alloc(MIN_ALLOC_SIZE); p != nullptr; p = allocator.alloc(MIN_ALLOC_SIZE)) {
+        blocks.push_back(p);
+    }
+    for (void* p : blocks) {
+        allocator.free(p, MIN_ALLOC_SIZE);
+    }
+
+    *defragmented = true;
+    for (std::size_t i = 0; i < blocks.size(); i++) {
+        if (allocator.alloc(MIN_ALLOC_SIZE) == nullptr) {
+            *defragmented = false;
+            break;
+        }
+    }
+    return blocks.size() * MIN_ALLOC_SIZE;
+}
+
+// Пачки как в сетевом коде: n объектов аллоцируются и сразу освобождаются
+// либо n вызовами cache_alloc/cache_free, либо cache_alloc_bulk/cache_free_bulk.
+// Пачка меряется целиком, поэтому steady_clock почти не влияет на ns на объект
+void bulk_benchmark(std::size_t object_size, std::size_t total_objects)
+{
+    std::printf("Bulk cache_alloc/cache_free, object size %zu\n", object_size);
+    const std::size_t batches[] = {32, 64, 128, 256};
+    for (std::size_t batch : batches) {
+        std::vector<void*> objects(batch);
+        std::size_t rounds = total_objects / batch;
+        double single_ns = 0;
+        double bulk_ns = 0;
+        for (int mode = 0; mode < 2; mode++) {
+            slab::cache cache;
+            slab::cache_setup(&cache, object_size);
+            auto start = std::chrono::steady_clock::now();
+            for (std::size_t round = 0; round < rounds; round++) {
+                if (mode == 0) {
+                    for (std::size_t i = 0; i < batch; i++) {
+                        objects[i] = slab::cache_alloc(&cache);
+                    }
+                    for (std::size_t i = 0; i < batch; i++) {
+                        slab::cache_free(&cache, objects[i]);
+                    }
+                } else {
+                    slab::cache_alloc_bulk(&cache, batch, objects.data());
+                    slab::cache_free_bulk(&cache, batch, objects.data());
+                }
+            }
+            auto end = std::chrono::steady_clock::now();
+            double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) /
+                        (rounds * batch);
+            (mode == 0 ? single_ns : bulk_ns) = ns;
+            slab::cache_release(&cache);
+        }
+        std::printf("  batch %3zu  single %6.2f ns/object  bulk %6.2f ns/object  speedup %.2fx\n",
+                    batch, single_ns, bulk_ns, single_ns / bulk_ns);
+    }
+}
+
+// Объект с дорогой инициализацией: кеш с конструктором против
+// cache_alloc + конструирование и разрушение на каждой операции
+struct PooledConnection {
+    std::mutex lock;
+    std::vector<char> buffer;
+    PooledConnection() { buffer.reserve(1024); }
+};
+
+void pool_benchmark(std::size_t ops)
+{
+    std::printf("SlabPool vs construct on every alloc, %zu ops\n", ops);
+    const std::size_t live = 64;
+    std::vector<PooledConnection*> objects(live);
+    for (int mode = 0; mode < 2; mode++) {
+        slab::SlabPool<PooledConnection> pool;
+        slab::cache cache;
+        slab::cache_setup(&cache, sizeof(PooledConnection));
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t round = 0; round < ops / live; round++) {
+            for (std::size_t i = 0; i < live; i++) {
+                objects[i] = mode == 0 ? new (slab::cache_alloc(&cache)) PooledConnection() : pool.alloc();
+                objects[i]->buffer.push_back(static_cast<char>(i));
+            }
+            for (std::size_t i = 0; i < live; i++) {
+                objects[i]->buffer.clear();
+                if (mode == 0) {
+                    objects[i]->~PooledConnection();
+                    slab::cache_free(&cache, objects[i]);
+                } else {
+                    pool.free(objects[i]);
+                }
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        slab::cache_release(&cache);
+        std::printf("  %-22s %7.2f ns/op\n", mode == 0 ? "construct every alloc" : "SlabPool",
+                    static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) /
+                        (ops / live * live));
+    }
+}
+
+// Магазины slab_alloc под нагрузкой из нескольких потоков: каждый поток
+// держит окно живых объектов, а каждый восьмой объект отдает на освобождение
+// соседнему потоку, чтобы объекты переходили между магазинами разных CPU.
+// Сравниваются cache_alloc/cache_free под общим mutex-ом и cache_alloc_mt/
+// cache_free_mt. В объект пишется метка владельца, которая проверяется при
+// освобождении, а в конце после cache_shrink у кеша не должно остаться
+// занятых slab-ов.
+void magazine_benchmark(std::size_t object_size, std::size_t ops_per_thread)
+{
+    std::printf("Multithreaded cache_alloc_mt/cache_free_mt, object size %zu, %zu ops per thread\n",
+                object_size, ops_per_thread);
+    unsigned hardware_threads = std::thread::hardware_concurrency();
+    std::vector<unsigned> thread_counts = {1, 2, 4, 8};
+    if (hardware_threads > 8) {
+        thread_counts.push_back(hardware_threads);
+    }
+    struct Inbox {
+        std::mutex lock;
+        std::vector<void*> objects;
+    };
+    for (unsigned threads_count : thread_counts) {
+        double mutex_mops = 0;
+        double magazine_mops = 0;
+        bool consistent = true;
+        for (int mode = 0; mode < 2; mode++) {
+            slab::cache cache;
+            slab::cache_setup(&cache, object_size);
+            std::mutex cache_lock;
+            std::vector<Inbox> inboxes(threads_count);
+            std::atomic<std::size_t> corrupted(0);
+            auto alloc = [&]() {
+                if (mode == 1) {
+                    return slab::cache_alloc_mt(&cache);
+                }
+                std::lock_guard<std::mutex> guard(cache_lock);
+                return slab::cache_alloc(&cache);
+            };
+            auto release = [&](void* p, std::uint64_t tag) {
+                if (*static_cast<std::uint64_t*>(p) != tag) {
+                    corrupted++;
+                }
+                if (mode == 1) {
+                    slab::cache_free_mt(&cache, p);
+                    return;
+                }
+                std::lock_guard<std::mutex> guard(cache_lock);
+                slab::cache_free(&cache, p);
+            };
+            // Метка - адрес объекта: чужой объект, выданный дважды, ее перезапишет
+            auto tag_of = [](void* p) {
+                return static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(p)) ^ 0x5a5a5a5a5a5a5a5aull;
+            };
+
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> threads;
+            for (unsigned t = 0; t < threads_count; t++) {
+                threads.emplace_back([&, t]() {
+                    std::mt19937 rng(t);
+                    std::vector<void*> live;
+                    std::vector<void*> incoming;
+                    Inbox& neighbour = inboxes[(t + 1) % threads_count];
+                    for (std::size_t i = 0; i < ops_per_thread; i++) {
+                        if (live.size() < 64 && (live.empty() || rng() % 2 == 0)) {
+                            void* p = alloc();
+                            if (p != nullptr) {
+                                *static_cast<std::uint64_t*>(p) = tag_of(p);
+                                live.push_back(p);
+                            }
+                            continue;
+                        }
+                        std::size_t index = rng() % live.size();
+                        void* p = live[index];
+                        live[index] = live.back();
+                        live.pop_back();
+                        if (threads_count > 1 && i % 8 == 0) {
+                            std::lock_guard<std::mutex> guard(neighbour.lock);
+                            neighbour.objects.push_back(p);
+                        } else {
+                            release(p, tag_of(p));
+                        }
+                        if (i % 64 == 0) {
+                            std::lock_guard<std::mutex> guard(inboxes[t].lock);
+                            incoming.swap(inboxes[t].objects);
+                        }
+                        for (void* q : incoming) {
+                            release(q, tag_of(q));
+                        }
+                        incoming.clear();
+                    }
+                    for (void* p : live) {
+                        release(p, tag_of(p));
+                    }
+                });
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            for (Inbox& inbox : inboxes) {
+                for (void* p : inbox.objects) {
+                    release(p, tag_of(p));
+                }
+            }
+            auto end = std::chrono::steady_clock::now();
+
+            slab::cache_shrink(&cache);
+            consistent = consistent && corrupted == 0 && cache.active_slabs == nullptr && cache.full_slabs == nullptr;
+            slab::cache_release(&cache);
+            double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+            (mode == 0 ? mutex_mops : magazine_mops) = threads_count * ops_per_thread / ns * 1e3;
+        }
+        std::printf("  threads %3u  mutex %7.2f Mops/s  magazines %7.2f Mops/s  %s\n",
+                    threads_count, mutex_mops, magazine_mops, consistent ? "consistent" : "BROKEN");
+    }
+}
+
+// myrealloc из alloc_v2 на растущих векторах: векторы растут в 1.5 раза
+// вперемешку с мелкими аллокациями, и сравнивается, сколько байт скопировал
+// бы myalloc + memcpy + myfree на каждом росте, и сколько на самом деле
+// скопировал myrealloc. interleaved - растут все векторы по очереди, иначе
+// каждый растет до конца перед следующим.
+void v2_realloc_benchmark(bool interleaved)
+{
+    const std::size_t buf_size = 1 << 20;
+    const int vectors_count = 8;
+    const int grow_steps = 12;
+    void* buf = std::malloc(buf_size);
+    v2::myset_fit_policy(v2::FitPolicy::FirstFit);
+    v2::mysetup(buf, buf_size);
+    v2::realloc_stats = v2::ReallocStats();
+
+    void* vectors[vectors_count];
+    std::size_t sizes[vectors_count];
+    for (int i = 0; i < vectors_count; i++) {
+        sizes[i] = 16;
+        vectors[i] = v2::myalloc(sizes[i]);
+    }
+
+    std::size_t naive_copied_bytes = 0;
+    for (int n = 0; n < vectors_count * grow_steps; n++) {
+        int i = interleaved ? n % vectors_count : n / grow_steps;
+        std::size_t new_size = sizes[i] + sizes[i] / 2;
+        void* grown = v2::myrealloc(vectors[i], new_size);
+        if (grown == nullptr) {
+            continue;
+        }
+        naive_copied_bytes += sizes[i] < new_size ? sizes[i] : new_size;
+        vectors[i] = grown;
+        sizes[i] = new_size;
+        // Мелкие аллокации между ростами, часть из них сразу освобождается
+        void* small = v2::myalloc(24);
+        if (n % 2 == 0) {
+            v2::myfree(small);
+        }
+    }
+
+    std::printf("  %-12s in place %3zu  moved %3zu  copied bytes %6zu of %6zu (saved %zu)\n",
+                interleaved ? "interleaved" : "sequential",
+                v2::realloc_stats.in_place, v2::realloc_stats.moved,
+                v2::realloc_stats.copied_bytes, naive_copied_bytes,
+                naive_copied_bytes - v2::realloc_stats.copied_bytes);
+    std::free(buf);
+}
+
+// Многопоточный режим alloc_v2: потоки аллоцируют и освобождают блоки
+// вперемешку через myalloc_mt/myfree_mt, большие (до 4Kb) с вероятностью
+// large_percent. Одна арена (все большие запросы под одним mutex-ом)
+// сравнивается с аренами по потокам. Кеши потоков возвращаются в арены
+// при выходе потоков, после чего каждая арена должна снова собраться в
+// один свободный блок.
+void v2_arena_benchmark(int threads_count, int arenas, int large_percent, std::size_t ops_per_thread)
+{
+    const std::size_t buf_size = 32 << 20;
+    void* buf = std::malloc(buf_size);
+    v2::mysetup_mt(buf, buf_size, arenas);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threads_count; t++) {
+        threads.emplace_back([t, large_percent, ops_per_thread]() {
+            std::mt19937 rng(t);
+            std::vector<void*> live;
+            for (std::size_t i = 0; i < ops_per_thread; i++) {
+                if (live.size() < 64 && rng() % 2 == 0) {
+                    std::size_t size = static_cast<int>(rng() % 100) < large_percent ? 512 + rng() % 3584 : 16 + rng() % 256;
+                    void* p = v2::myalloc_mt(size);
+                    if (p != nullptr) {
+                        live.push_back(p);
+                    }
+                } else if (!live.empty()) {
+                    std::size_t index = rng() % live.size();
+                    v2::myfree_mt(live[index]);
+                    live[index] = live.back();
+                    live.pop_back();
+                }
+            }
+            for (void* p : live) {
+                v2::myfree_mt(p);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    bool defragmented = true;
+    for (int i = 0; i < v2::mt_arenas_count; i++) {
+        v2::Heap* heap = &v2::mt_arenas[i].heap;
+        defragmented = defragmented && heap->free_blocks == 1 &&
+                       heap->free_bytes == static_cast<std::size_t>(heap->heap_end - reinterpret_cast<std::uint8_t*>(heap->head));
+    }
+    double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    std::printf("  threads %3d  arenas %d  %9.0f Kops/s  heap %s\n",
+                threads_count, v2::mt_arenas_count, threads_count * ops_per_thread / ns * 1e6,
+                defragmented ? "defragmented" : "BROKEN");
+    v2::myteardown_mt();
+    std::free(buf);
+}
+
+int main(int argc, char const *argv[])
+{
+    std::size_t buf_size = 1 << 20;
+    std::size_t ops = 1000000;
+    const char* trace_path = nullptr;
+    std::string save_prefix;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--buf" && i + 1 < argc) {
+            buf_size = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--ops" && i + 1 < argc) {
+            ops = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--save" && i + 1 < argc) {
+            save_prefix = argv[++i];
+        } else if (arg[0] != '-') {
+            trace_path = argv[i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--buf bytes] [--ops count] [--save prefix] [trace-file]\n";
+            return 1;
+        }
+    }
+
+    // Аллокаторы не обязаны помещать в буфер все живые объекты трассы -
+    // оставляем им запас на метаданные и фрагментацию
+    std::size_t max_live_bytes = buf_size / 2;
+    std::vector<Trace> traces;
+    if (trace_path != nullptr) {
+        Trace trace;
+        if (!load_trace(trace_path, &trace)) {
+            std::cerr << "Cannot read trace " << trace_path << "\n";
+            return 1;
+        }
+        traces.push_back(trace);
+    } else {
+        traces.push_back(uniform_trace(ops, max_live_bytes));
+        traces.push_back(power_law_trace(ops, max_live_bytes));
+        traces.push_back(producer_consumer_trace(ops, max_live_bytes));
+        traces.push_back(long_lived_churn_trace(ops, max_live_bytes));
+    }
+    if (!save_prefix.empty()) {
+        for (const Trace& trace : traces) {
+            save_trace(trace, save_prefix + trace.name + ".trace");
+        }
+    }
+
+    void* buf = std::malloc(buf_size);
+    std::vector<Allocator> allocators = make_allocators();
+
+    std::printf("BufSize %zu\n", buf_size);
+    for (const Allocator& allocator : allocators) {
+        if (!allocator.uses_buffer) {
+            continue;
+        }
+        bool defragmented = false;
+        std::size_t max_size = find_max_size(allocator, buf, buf_size);
+        std::size_t effective_size = find_effective_size(allocator, buf, buf_size, &defragmented);
+        std::printf("  %-18s MaxSize %8zu (%.3f, need >= 0.889)  EffectiveSize %8zu (%.3f, need >= 0.111)  defragmentation %s\n",
+                    allocator.name,
+                    max_size, static_cast<double>(max_size) / buf_size,
+                    effective_size, static_cast<double>(effective_size) / buf_size,
+                    defragmented ? "ok" : "FAILED");
+    }
+
+    for (const Trace& trace : traces) {
+        std::printf("Trace %s: %zu ops\n", trace.name.c_str(), trace.ops.size());
+        for (const Allocator& allocator : allocators) {
+            replay(trace, allocator, buf, buf_size);
+        }
+    }
+
+    bulk_benchmark(64, ops);
+    bulk_benchmark(256, ops);
+    pool_benchmark(ops);
+    magazine_benchmark(64, ops);
+
+    std::printf("alloc_v2 myrealloc on growing vectors\n");
+    v2_realloc_benchmark(false);
+    v2_realloc_benchmark(true);
+
+    int threads_count = static_cast<int>(std::thread::hardware_concurrency());
+    threads_count = threads_count < 2 ? 2 : threads_count;
+    std::printf("alloc_v2 myalloc_mt/myfree_mt, 50%% large blocks, %zu ops per thread\n", ops);
+    for (int arenas : {1, v2::MT_MAX_ARENAS}) {
+        v2_arena_benchmark(1, arenas, 50, ops);
+        v2_arena_benchmark(threads_count, arenas, 50, ops);
+    }
+
+    std::free(buf);
+    return 0;
+}
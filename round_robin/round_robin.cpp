@@ -1,42 +1,387 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <vector>
 
-struct Node
+/**
+ * Очереди готовых потоков - интрузивные двусвязные кольца
+ * поверх массива, индексированного идентификатором потока.
+ * Голова кольца - первый в очереди, перед ней (prev) -
+ * хвост. Поэтому постановка в хвост, снятие с CPU и ротация
+ * по истечении кванта - O(1) и без аллокаций: массив растет
+ * только в new_thread, когда появляется идентификатор
+ * больше всех прежних.
+ *
+ * Колец по одному на уровень приоритета, непустые уровни
+ * отмечены в level_bitmap, а на CPU всегда голова самого
+ * приоритетного непустого уровня. Round robin использует
+ * только уровень 0. FairShare колец не использует, см.
+ * fair_pick_next.
+ **/
+enum class SchedulerMode
+{
+    RoundRobin,
+    Mlfq,     /* multi-level feedback queue */
+    FairShare /* взвешенное виртуальное время, как CFS */
+};
+
+struct ThreadSlot
 {
-    int thread_id;
-    Node* next;
+    int next;              /* соседи в кольце, -1 если поток не в очереди */
+    int prev;
+    int used;              /* сколько тиков квант уже отработан */
+    int level;             /* уровень заблокированного потока, см. block_thread */
+    std::uint32_t epoch;   /* boost_epoch на момент блокировки */
+    std::uint64_t vruntime; /* виртуальное время в режиме FairShare */
+    int weight;
+    int heap_index;        /* позиция в fair_heap, -1 если потока там нет */
 };
 
-Node* queue_head;
-Node* queue_tail;
-int current_time = 0;
+static const int MLFQ_LEVELS = 4;
+static const int MLFQ_BOOST_QUANTA = 64; /* период общего буста в квантах уровня 0 */
+
+SchedulerMode scheduler_mode = SchedulerMode::RoundRobin;
+std::vector<ThreadSlot> threads;
+int queue_heads[MLFQ_LEVELS];
+int queue_lengths[MLFQ_LEVELS];
+std::uint32_t level_bitmap;
+int levels_count;
 int max_timeslice;
+long long ticks_to_boost;
+std::uint32_t boost_epoch;
+
+static const int FAIR_DEFAULT_WEIGHT = 1024;
+static const std::uint64_t FAIR_VRUNTIME_SCALE = std::uint64_t(1) << 20;
+
+std::vector<int> fair_heap; /* готовые потоки кроме текущего, min-куча по vruntime */
+int fair_current;
+std::uint64_t fair_min_vruntime;
+
+/**
+ * Режим планировщика, применяется в следующем scheduler_setup.
+ **/
+void scheduler_set_mode(SchedulerMode mode)
+{
+    scheduler_mode = mode;
+}
+
+/**
+ * Квант уровня: на каждом следующем уровне вдвое длиннее.
+ **/
+int level_timeslice(int level)
+{
+    return max_timeslice << level;
+}
+
+int top_level()
+{
+    return __builtin_ctz(level_bitmap);
+}
 
-void add_thread_to_tail(int thread_id)
+void add_thread_to_tail(int level, int thread_id)
 {
-    if (queue_head == nullptr) {
-        queue_head = new Node();
-        queue_tail = queue_head;
+    ThreadSlot& slot = threads[thread_id];
+    int& head = queue_heads[level];
+    if (head == -1) {
+        slot.next = thread_id;
+        slot.prev = thread_id;
+        head = thread_id;
+        queue_lengths[level] = 1;
+        level_bitmap |= 1u << level;
+        return;
+    }
+
+    int tail = threads[head].prev;
+    slot.next = head;
+    slot.prev = tail;
+    threads[tail].next = thread_id;
+    threads[head].prev = thread_id;
+    queue_lengths[level]++;
+}
+
+int remove_thread_from_head(int level)
+{
+    int& head = queue_heads[level];
+    int thread_id = head;
+    ThreadSlot& slot = threads[thread_id];
+    if (slot.next == thread_id) {
+        head = -1;
+        level_bitmap &= ~(1u << level);
     } else {
-        queue_tail->next = new Node();
-        queue_tail = queue_tail->next;
+        threads[slot.prev].next = slot.next;
+        threads[slot.next].prev = slot.prev;
+        head = slot.next;
     }
-    queue_tail->thread_id = thread_id;
-    queue_tail->next = nullptr;
+    queue_lengths[level]--;
+    slot.next = -1;
+    slot.prev = -1;
+    slot.used = 0;
+    return thread_id;
 }
 
-int remove_thread_from_head() {
-    current_time = 0;
-    if (queue_head == nullptr) {
-        return -1;
+/**
+ * Защита от голодания в MLFQ: раз в период все готовые
+ * потоки поднимаются на уровень 0. Кольца уровней просто
+ * склеиваются за O(MLFQ_LEVELS), а заблокированные потоки
+ * узнают о бусте по boost_epoch, когда проснутся.
+ **/
+void boost_all_levels()
+{
+    for (int level = 1; level < levels_count; level++) {
+        int head = queue_heads[level];
+        if (head == -1) {
+            continue;
+        }
+        int& top = queue_heads[0];
+        if (top == -1) {
+            top = head;
+        } else {
+            int top_tail = threads[top].prev;
+            int tail = threads[head].prev;
+            threads[top_tail].next = head;
+            threads[head].prev = top_tail;
+            threads[tail].next = top;
+            threads[top].prev = tail;
+        }
+        queue_heads[level] = -1;
+        queue_lengths[0] += queue_lengths[level];
+        queue_lengths[level] = 0;
     }
+    level_bitmap = level_bitmap != 0 ? 1u : 0u;
+    boost_epoch++;
+}
+
+/**
+ * Режим FairShare. Каждый тик текущему потоку добавляется
+ * FAIR_VRUNTIME_SCALE / weight виртуального времени, так что
+ * поток с вдвое большим весом получает вдвое больше CPU.
+ * Текущий поток в куче не лежит (как curr в CFS); когда он
+ * отработал квант и его vruntime больше минимального в куче,
+ * он меняется местами с потоком на вершине кучи. Куча -
+ * массив идентификаторов, а позиция каждого потока хранится
+ * в его слоте, поэтому вставка и удаление - O(log n) и без
+ * аллокаций.
+ **/
+bool fair_less(int lhs, int rhs)
+{
+    return threads[lhs].vruntime < threads[rhs].vruntime;
+}
 
-    int thread_id = queue_head->thread_id;
-    queue_head = queue_head->next;
+void fair_heap_place(std::size_t index, int thread_id)
+{
+    fair_heap[index] = thread_id;
+    threads[thread_id].heap_index = static_cast<int>(index);
+}
+
+void fair_sift_up(std::size_t index)
+{
+    int thread_id = fair_heap[index];
+    while (index > 0) {
+        std::size_t parent = (index - 1) / 2;
+        if (!fair_less(thread_id, fair_heap[parent])) {
+            break;
+        }
+        fair_heap_place(index, fair_heap[parent]);
+        index = parent;
+    }
+    fair_heap_place(index, thread_id);
+}
+
+void fair_sift_down(std::size_t index)
+{
+    int thread_id = fair_heap[index];
+    std::size_t size = fair_heap.size();
+    for (;;) {
+        std::size_t child = 2 * index + 1;
+        if (child >= size) {
+            break;
+        }
+        if (child + 1 < size && fair_less(fair_heap[child + 1], fair_heap[child])) {
+            child++;
+        }
+        if (!fair_less(fair_heap[child], thread_id)) {
+            break;
+        }
+        fair_heap_place(index, fair_heap[child]);
+        index = child;
+    }
+    fair_heap_place(index, thread_id);
+}
+
+void fair_push(int thread_id)
+{
+    fair_heap.push_back(thread_id);
+    fair_sift_up(fair_heap.size() - 1);
+}
+
+int fair_pop()
+{
+    int thread_id = fair_heap[0];
+    int last = fair_heap.back();
+    fair_heap.pop_back();
+    if (!fair_heap.empty()) {
+        fair_heap[0] = last;
+        fair_sift_down(0);
+    }
+    threads[thread_id].heap_index = -1;
     return thread_id;
 }
 
+/**
+ * min_vruntime только растет: это наименьшее vruntime среди
+ * готовых потоков, относительно него ставятся новые и
+ * проснувшиеся потоки.
+ **/
+void fair_update_min_vruntime()
+{
+    std::uint64_t vruntime = fair_min_vruntime;
+    bool found = false;
+    if (fair_current != -1) {
+        vruntime = threads[fair_current].vruntime;
+        found = true;
+    }
+    if (!fair_heap.empty()) {
+        std::uint64_t top = threads[fair_heap[0]].vruntime;
+        vruntime = found && vruntime < top ? vruntime : top;
+        found = true;
+    }
+    if (found && vruntime > fair_min_vruntime) {
+        fair_min_vruntime = vruntime;
+    }
+}
+
+void fair_pick_next()
+{
+    fair_current = fair_heap.empty() ? -1 : fair_pop();
+    if (fair_current != -1) {
+        threads[fair_current].used = 0;
+    }
+}
+
+/**
+ * vruntime кванта потока с весом по умолчанию.
+ **/
+std::uint64_t fair_slice_vruntime()
+{
+    return FAIR_VRUNTIME_SCALE / FAIR_DEFAULT_WEIGHT * max_timeslice;
+}
+
+/**
+ * Ставит готовый поток в очередь. Проснувшийся поток
+ * получает не меньше min_vruntime минус половина кванта:
+ * небольшой бонус за сон, но не весь накопленный отрыв,
+ * иначе после долгого сна он монополизировал бы CPU. Если
+ * он отстает от текущего больше чем на четверть кванта, то
+ * сразу вытесняет его (как wakeup preemption в CFS).
+ **/
+void fair_enqueue(int thread_id, bool woken)
+{
+    ThreadSlot& slot = threads[thread_id];
+    std::uint64_t floor = fair_min_vruntime;
+    if (woken) {
+        std::uint64_t bonus = fair_slice_vruntime() / 2;
+        floor = floor > bonus ? floor - bonus : 0;
+    }
+    if (slot.vruntime < floor) {
+        slot.vruntime = floor;
+    }
+    slot.used = 0;
+    if (fair_current == -1) {
+        fair_current = thread_id;
+    } else if (woken && slot.vruntime + fair_slice_vruntime() / 4 < threads[fair_current].vruntime) {
+        fair_push(fair_current);
+        fair_current = thread_id;
+    } else {
+        fair_push(thread_id);
+    }
+}
+
+void fair_tick()
+{
+    if (fair_current == -1) {
+        return;
+    }
+    ThreadSlot& slot = threads[fair_current];
+    slot.vruntime += FAIR_VRUNTIME_SCALE / slot.weight;
+    // Как и в fair_advance, дальше кванта used не растет: с пустой кучей
+    // единственный поток иначе переполнил бы его на долгой работе
+    if (slot.used < max_timeslice) {
+        slot.used++;
+    }
+    fair_update_min_vruntime();
+    if (slot.used >= max_timeslice && !fair_heap.empty() && fair_less(fair_heap[0], fair_current)) {
+        int previous = fair_current;
+        fair_pick_next();
+        fair_push(previous);
+    }
+}
+
+/**
+ * Через сколько тиков fair_tick сменит текущий поток, если
+ * ничего больше не произойдет: квант должен быть отработан и
+ * vruntime должно обогнать вершину кучи. -1 - никогда.
+ **/
+long long fair_ticks_to_preempt()
+{
+    if (fair_current == -1 || fair_heap.empty()) {
+        return -1;
+    }
+    const ThreadSlot& slot = threads[fair_current];
+    std::uint64_t delta = FAIR_VRUNTIME_SCALE / slot.weight;
+    std::uint64_t top = threads[fair_heap[0]].vruntime;
+    long long by_quantum = slot.used < max_timeslice ? max_timeslice - slot.used : 1;
+    long long by_vruntime = 1;
+    if (slot.vruntime <= top) {
+        if (delta == 0) {
+            return -1;
+        }
+        by_vruntime = static_cast<long long>((top - slot.vruntime) / delta + 1);
+    }
+    return by_quantum > by_vruntime ? by_quantum : by_vruntime;
+}
+
+/**
+ * ticks вызовов fair_tick за O(log n) на каждую смену
+ * текущего потока. min_vruntime достаточно пересчитать в
+ * конце каждого отрезка: пока текущий поток не сменился, он
+ * только растет.
+ **/
+void fair_advance(long long ticks)
+{
+    while (ticks > 0 && fair_current != -1) {
+        long long until = fair_ticks_to_preempt();
+        long long step = until == -1 || until > ticks ? ticks : until;
+        ThreadSlot& slot = threads[fair_current];
+        slot.vruntime += FAIR_VRUNTIME_SCALE / slot.weight * static_cast<std::uint64_t>(step);
+        // Дальше кванта used не нужен, а так он не переполнится на долгих отрезках
+        slot.used = step < max_timeslice - slot.used ? slot.used + static_cast<int>(step) : max_timeslice;
+        fair_update_min_vruntime();
+        ticks -= step;
+        if (step == until) {
+            int previous = fair_current;
+            fair_pick_next();
+            fair_push(previous);
+        }
+    }
+}
+
+/**
+ * Вес потока для режима FairShare (по умолчанию
+ * FAIR_DEFAULT_WEIGHT). Доля CPU потока пропорциональна его
+ * весу. Менять вес можно в любой момент после new_thread.
+ * Вес больше FAIR_VRUNTIME_SCALE отвергается (возвращается
+ * false, вес не меняется): у такого потока vruntime за тик
+ * не рос бы вовсе.
+ **/
+bool set_thread_weight(int thread_id, int weight)
+{
+    if (weight > 0 && static_cast<std::uint64_t>(weight) > FAIR_VRUNTIME_SCALE) {
+        return false;
+    }
+    threads[thread_id].weight = weight > 0 ? weight : 1;
+    return true;
+}
+
 /**
  * Функция будет вызвана перед каждым тестом, если вы
  * используете глобальные и/или статические переменные
@@ -46,13 +391,25 @@ int remove_thread_from_head() {
  *
  * timeslice - квант времени, который нужно использовать.
  * Поток смещается с CPU, если пока он занимал CPU функция
- * timer_tick была вызвана timeslice раз.
+ * timer_tick была вызвана timeslice раз. В режиме MLFQ это
+ * квант верхнего уровня.
  **/
 void scheduler_setup(int timeslice)
 {
     max_timeslice = timeslice;
-    queue_head = nullptr;
-    queue_tail = nullptr;
+    levels_count = scheduler_mode == SchedulerMode::Mlfq ? MLFQ_LEVELS : 1;
+    for (int level = 0; level < MLFQ_LEVELS; level++) {
+        queue_heads[level] = -1;
+        queue_lengths[level] = 0;
+    }
+    level_bitmap = 0;
+    ticks_to_boost = static_cast<long long>(MLFQ_BOOST_QUANTA) * timeslice;
+    boost_epoch = 0;
+    fair_heap.clear();
+    fair_current = -1;
+    fair_min_vruntime = 0;
+    // clear оставляет память от прошлых тестов - повторные запуски не аллоцируют
+    threads.clear();
 }
 
 /**
@@ -62,7 +419,19 @@ void scheduler_setup(int timeslice)
  **/
 void new_thread(int thread_id)
 {
-    add_thread_to_tail(thread_id);
+    if (static_cast<std::size_t>(thread_id) >= threads.size()) {
+        threads.resize(thread_id + 1, ThreadSlot{-1, -1, 0, 0, 0, 0, FAIR_DEFAULT_WEIGHT, -1});
+    }
+    threads[thread_id].used = 0;
+    if (scheduler_mode == SchedulerMode::FairShare) {
+        // Куча не больше числа слотов - резервируем здесь, чтобы не аллоцировать на wake
+        fair_heap.reserve(threads.size());
+        threads[thread_id].vruntime = 0;
+        threads[thread_id].weight = FAIR_DEFAULT_WEIGHT;
+        fair_enqueue(thread_id, false);
+        return;
+    }
+    add_thread_to_tail(0, thread_id);
 }
 
 /**
@@ -74,7 +443,13 @@ void new_thread(int thread_id)
  **/
 void exit_thread()
 {
-    remove_thread_from_head();
+    if (scheduler_mode == SchedulerMode::FairShare) {
+        fair_pick_next();
+        return;
+    }
+    if (level_bitmap != 0) {
+        remove_thread_from_head(top_level());
+    }
 }
 
 /**
@@ -86,32 +461,76 @@ void exit_thread()
  **/
 void block_thread()
 {
-    remove_thread_from_head();
+    if (scheduler_mode == SchedulerMode::FairShare) {
+        fair_pick_next();
+        return;
+    }
+    if (level_bitmap == 0) {
+        return;
+    }
+    int level = top_level();
+    int thread_id = remove_thread_from_head(level);
+    threads[thread_id].level = level;
+    threads[thread_id].epoch = boost_epoch;
 }
 
 /**
  * Функция вызывается, когда один из заблокированных потоков
  * разблокируется. Гарантируется, что thread_id - идентификатор
  * ранее заблокированного потока.
+ *
+ * В MLFQ проснувшийся поток поднимается на уровень выше
+ * того, на котором заблокировался (если с тех пор не было
+ * общего буста), поэтому потоки, которые быстро уходят в
+ * IO, не ждут за потоками, занимающими CPU.
  **/
 void wake_thread(int thread_id)
 {
-    add_thread_to_tail(thread_id);
+    if (scheduler_mode == SchedulerMode::FairShare) {
+        fair_enqueue(thread_id, true);
+        return;
+    }
+    ThreadSlot& slot = threads[thread_id];
+    int level = slot.epoch == boost_epoch ? slot.level : 0;
+    add_thread_to_tail(level > 0 ? level - 1 : 0, thread_id);
 }
 
 /**
  * Ваш таймер. Вызывается каждый раз, когда проходит единица
  * времени.
+ *
+ * В MLFQ поток, отработавший весь квант своего уровня,
+ * опускается на уровень ниже (на последнем - просто уходит
+ * в хвост), а раз в MLFQ_BOOST_QUANTA квантов все потоки
+ * поднимаются наверх.
  **/
 void timer_tick()
 {
-    if (queue_head == nullptr) {
+    if (scheduler_mode == SchedulerMode::FairShare) {
+        fair_tick();
         return;
     }
+    if (level_bitmap != 0) {
+        int level = top_level();
+        int thread_id = queue_heads[level];
+        ThreadSlot& slot = threads[thread_id];
+        slot.used++;
+        // >=, а не ==: после общего буста used может оказаться больше кванта уровня 0
+        if (slot.used >= level_timeslice(level)) {
+            slot.used = 0;
+            if (level + 1 < levels_count) {
+                remove_thread_from_head(level);
+                add_thread_to_tail(level + 1, thread_id);
+            } else {
+                // Ротация кольца: текущий поток становится хвостом без перестановки ссылок
+                queue_heads[level] = slot.next;
+            }
+        }
+    }
 
-    current_time++;
-    if (current_time == max_timeslice) {
-        add_thread_to_tail(remove_thread_from_head());
+    if (scheduler_mode == SchedulerMode::Mlfq && --ticks_to_boost == 0) {
+        ticks_to_boost = static_cast<long long>(MLFQ_BOOST_QUANTA) * max_timeslice;
+        boost_all_levels();
     }
 }
 
@@ -124,9 +543,191 @@ void timer_tick()
  **/
 int current_thread()
 {
-    if (queue_head == nullptr) {
+    if (scheduler_mode == SchedulerMode::FairShare) {
+        return fair_current;
+    }
+    return level_bitmap != 0 ? queue_heads[top_level()] : -1;
+}
+
+/**
+ * Безтиковый режим: вместо timer_tick на каждую единицу
+ * времени хост спрашивает next_preemption_deadline, взводит
+ * один таймер и по нему (или раньше, на block/wake/exit)
+ * вызывает advance_time с прошедшим временем. Результат тот
+ * же, что у ticks вызовов timer_tick.
+ *
+ * Тики текущего потока на уровне, с которого он не
+ * опускается (round robin или последний уровень MLFQ),
+ * применяются сразу: считается, сколько целых квантов
+ * прошло, и голова кольца сдвигается на это число по модулю
+ * длины кольца. До ближайшего дедлайна это O(1), в общем
+ * случае - не больше длины кольца шагов. В MLFQ отрезки
+ * дополнительно режутся на опускании потока на уровень
+ * ниже и на общем бусте.
+ **/
+long long advance_top_level(long long ticks)
+{
+    int level = top_level();
+    int thread_id = queue_heads[level];
+    ThreadSlot& slot = threads[thread_id];
+    long long timeslice = level_timeslice(level);
+    long long left = slot.used < timeslice ? timeslice - slot.used : 1;
+    if (ticks < left) {
+        slot.used += static_cast<int>(ticks);
+        return ticks;
+    }
+    slot.used = 0;
+    if (level + 1 < levels_count) {
+        remove_thread_from_head(level);
+        add_thread_to_tail(level + 1, thread_id);
+        return left;
+    }
+
+    long long rest = ticks - left;
+    long long rotations = 1 + rest / timeslice;
+    long long steps = rotations % queue_lengths[level];
+    int head = thread_id;
+    for (long long step = 0; step < steps; step++) {
+        head = threads[head].next;
+    }
+    queue_heads[level] = head;
+    threads[head].used = static_cast<int>(rest % timeslice);
+    return ticks;
+}
+
+void advance_time(long long ticks)
+{
+    if (scheduler_mode == SchedulerMode::FairShare) {
+        fair_advance(ticks);
+        return;
+    }
+    while (ticks > 0) {
+        long long step = ticks;
+        if (scheduler_mode == SchedulerMode::Mlfq && ticks_to_boost < step) {
+            step = ticks_to_boost;
+        }
+        if (level_bitmap != 0) {
+            step = advance_top_level(step);
+        }
+        ticks -= step;
+        if (scheduler_mode == SchedulerMode::Mlfq && (ticks_to_boost -= step) == 0) {
+            ticks_to_boost = static_cast<long long>(MLFQ_BOOST_QUANTA) * max_timeslice;
+            boost_all_levels();
+        }
+    }
+}
+
+/**
+ * Через сколько единиц времени планировщику нужно снова
+ * отдать CPU (вызвать advance_time), если до тех пор никто
+ * не заблокируется, не проснется и не завершится, или -1,
+ * если текущий поток некому вытеснить и таймер можно не
+ * взводить. В MLFQ дедлайн может быть раньше реальной смены
+ * потока (опускание на пустой уровень, общий буст) - лишний
+ * вызов advance_time ничего не ломает.
+ **/
+long long next_preemption_deadline()
+{
+    if (scheduler_mode == SchedulerMode::FairShare) {
+        return fair_ticks_to_preempt();
+    }
+    int runnable = 0;
+    for (int level = 0; level < levels_count; level++) {
+        runnable += queue_lengths[level];
+    }
+    if (runnable < 2) {
         return -1;
-    
     }
-    return queue_head->thread_id;
+    int level = top_level();
+    const ThreadSlot& slot = threads[queue_heads[level]];
+    long long timeslice = level_timeslice(level);
+    long long deadline = slot.used < timeslice ? timeslice - slot.used : 1;
+    if (scheduler_mode == SchedulerMode::Mlfq && ticks_to_boost < deadline) {
+        deadline = ticks_to_boost;
+    }
+    return deadline;
+}
+
+#ifdef ROUND_ROBIN_BENCH
+#include <chrono>
+#include <cstdio>
+#include <new>
+#include <random>
+#include <string>
+
+// Считаем аллокации, чтобы убедиться, что на tick/block/wake их нет
+std::size_t allocations = 0;
+
+void* operator new(std::size_t size)
+{
+    allocations++;
+    void* ptr = std::malloc(size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+/**
+ * Сборка: g++ -O2 -DROUND_ROBIN_BENCH round_robin/round_robin.cpp
+ * Запуск: ./a.out [threads] [ticks] [rr|mlfq|fair]
+ **/
+int main(int argc, char const *argv[])
+{
+    int threads_count = argc > 1 ? std::atoi(argv[1]) : 1000;
+    long long ticks = argc > 2 ? std::atoll(argv[2]) : 10000000;
+    std::string mode = argc > 3 ? argv[3] : "rr";
+
+    if (mode == "mlfq") {
+        scheduler_set_mode(SchedulerMode::Mlfq);
+    } else if (mode == "fair") {
+        scheduler_set_mode(SchedulerMode::FairShare);
+    } else {
+        scheduler_set_mode(SchedulerMode::RoundRobin);
+    }
+    scheduler_setup(4);
+    for (int thread_id = 0; thread_id < threads_count; thread_id++) {
+        new_thread(thread_id);
+    }
+
+    std::vector<int> blocked;
+    blocked.reserve(threads_count);
+    std::mt19937 rng(42);
+    std::size_t allocations_before = allocations;
+    long long operations = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (long long tick = 0; tick < ticks; tick++) {
+        timer_tick();
+        operations++;
+        unsigned event = rng() % 8;
+        if (event == 0 && current_thread() != -1) {
+            blocked.push_back(current_thread());
+            block_thread();
+            operations++;
+        } else if (event == 1 && !blocked.empty()) {
+            std::size_t index = rng() % blocked.size();
+            wake_thread(blocked[index]);
+            blocked[index] = blocked.back();
+            blocked.pop_back();
+            operations++;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    std::printf("%s, threads %d, ticks %lld: %.2f ns/operation, allocations during run %zu\n",
+                mode.c_str(), threads_count, ticks, ns / operations, allocations - allocations_before);
+    return 0;
 }
+#endif
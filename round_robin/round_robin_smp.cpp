@@ -0,0 +1,426 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+/**
+ * Многопроцессорный вариант round_robin.cpp: у каждого CPU
+ * своя очередь - интрузивное кольцо поверх общего массива
+ * слотов потоков, голова кольца исполняется на этом CPU.
+ * Каждый CPU обычно трогает только свою очередь под своей
+ * блокировкой, поэтому timer_tick и current_thread разных
+ * CPU можно вызывать одновременно из разных потоков ОС.
+ *
+ * Балансировка двух видов:
+ *  - CPU, у которого кончились готовые потоки, сразу крадет
+ *    один у самого загруженного соседа;
+ *  - раз в SMP_BALANCE_INTERVAL тиков CPU забирает у самого
+ *    загруженного соседа половину разницы в длине очередей,
+ *    но только потоки, которые давно не исполнялись (не
+ *    "горячие" в кеше, см. SMP_CACHE_HOT_TICKS).
+ * Проснувшийся поток возвращается на CPU, где исполнялся.
+ **/
+static const int SMP_MAX_CPUS = 64;
+static const long long SMP_BALANCE_INTERVAL = 64;
+static const long long SMP_CACHE_HOT_TICKS = 16;
+
+struct spinlock
+{
+    std::atomic<bool> locked;
+};
+
+void spin_lock(spinlock *lock)
+{
+    while (lock->locked.exchange(true, std::memory_order_acquire)) {
+        while (lock->locked.load(std::memory_order_relaxed)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void spin_unlock(spinlock *lock)
+{
+    lock->locked.store(false, std::memory_order_release);
+}
+
+struct ThreadSlot
+{
+    int next;           /* соседи в кольце, -1 если поток не в очереди */
+    int prev;
+    int used;           /* сколько тиков квант уже отработан */
+    int cpu;            /* CPU, в очереди которого поток стоит или стоял */
+    long long last_run; /* clock этого CPU, когда поток последний раз ушел с него */
+};
+
+/**
+ * Очередь одного CPU. Выровнена на кеш линию, чтобы тики
+ * разных CPU не мешали друг другу через false sharing.
+ * nr_running читается соседями без блокировки - это только
+ * подсказка, кого обкрадывать.
+ **/
+struct alignas(64) CpuRunqueue
+{
+    spinlock lock;
+    int head;
+    std::atomic<int> nr_running;
+    long long clock;
+    long long next_balance;
+};
+
+std::vector<ThreadSlot> threads;
+CpuRunqueue runqueues[SMP_MAX_CPUS];
+int cpus_count;
+int max_timeslice;
+std::atomic<long long> steals(0);
+std::atomic<long long> migrations(0);
+
+void enqueue_tail(CpuRunqueue *rq, int cpu, int thread_id)
+{
+    ThreadSlot& slot = threads[thread_id];
+    slot.cpu = cpu;
+    slot.used = 0;
+    if (rq->head == -1) {
+        slot.next = thread_id;
+        slot.prev = thread_id;
+        rq->head = thread_id;
+    } else {
+        int tail = threads[rq->head].prev;
+        slot.next = rq->head;
+        slot.prev = tail;
+        threads[tail].next = thread_id;
+        threads[rq->head].prev = thread_id;
+    }
+    rq->nr_running.store(rq->nr_running.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void dequeue(CpuRunqueue *rq, int thread_id)
+{
+    ThreadSlot& slot = threads[thread_id];
+    if (slot.next == thread_id) {
+        rq->head = -1;
+    } else {
+        threads[slot.prev].next = slot.next;
+        threads[slot.next].prev = slot.prev;
+        if (rq->head == thread_id) {
+            rq->head = slot.next;
+        }
+    }
+    slot.next = -1;
+    slot.prev = -1;
+    rq->nr_running.store(rq->nr_running.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+}
+
+int find_busiest_cpu(int cpu)
+{
+    int busiest = -1;
+    int busiest_load = 0;
+    for (int other = 0; other < cpus_count; other++) {
+        int load = runqueues[other].nr_running.load(std::memory_order_relaxed);
+        if (other != cpu && load > busiest_load) {
+            busiest = other;
+            busiest_load = load;
+        }
+    }
+    return busiest;
+}
+
+/**
+ * Берет блокировки двух очередей всегда в порядке номеров
+ * CPU, чтобы встречные балансировки не зависли.
+ **/
+void lock_pair(int first, int second)
+{
+    spin_lock(&runqueues[first < second ? first : second].lock);
+    spin_lock(&runqueues[first < second ? second : first].lock);
+}
+
+void unlock_pair(int first, int second)
+{
+    spin_unlock(&runqueues[first].lock);
+    spin_unlock(&runqueues[second].lock);
+}
+
+/**
+ * Переносит в очередь cpu до count потоков из очереди src.
+ * Исполняющийся на src поток (голова) не трогается, берутся
+ * потоки сразу за ним - они ждут дольше всех. Если
+ * only_cold, пропускаются потоки, ушедшие с CPU меньше
+ * SMP_CACHE_HOT_TICKS тиков назад. Вызывается под
+ * блокировками обеих очередей.
+ **/
+int migrate_threads(int src, int cpu, int count, bool only_cold)
+{
+    CpuRunqueue *from = &runqueues[src];
+    CpuRunqueue *to = &runqueues[cpu];
+    int moved = 0;
+    if (from->head == -1) {
+        return 0;
+    }
+    int candidate = threads[from->head].next;
+    while (moved < count && candidate != from->head) {
+        int next = threads[candidate].next;
+        if (!only_cold || from->clock - threads[candidate].last_run >= SMP_CACHE_HOT_TICKS) {
+            dequeue(from, candidate);
+            enqueue_tail(to, cpu, candidate);
+            // На новом CPU кеш потока холодный
+            threads[candidate].last_run = to->clock - SMP_CACHE_HOT_TICKS;
+            moved++;
+        }
+        candidate = next;
+    }
+    return moved;
+}
+
+/**
+ * Простаивающий CPU крадет один поток у самого загруженного.
+ **/
+void steal_if_idle(int cpu)
+{
+    CpuRunqueue *rq = &runqueues[cpu];
+    if (rq->nr_running.load(std::memory_order_relaxed) != 0) {
+        return;
+    }
+    int busiest = find_busiest_cpu(cpu);
+    if (busiest == -1 || runqueues[busiest].nr_running.load(std::memory_order_relaxed) < 2) {
+        return;
+    }
+    lock_pair(cpu, busiest);
+    if (rq->head == -1 && migrate_threads(busiest, cpu, 1, false) != 0) {
+        steals.fetch_add(1, std::memory_order_relaxed);
+    }
+    unlock_pair(cpu, busiest);
+}
+
+void load_balance(int cpu)
+{
+    int busiest = find_busiest_cpu(cpu);
+    if (busiest == -1) {
+        return;
+    }
+    lock_pair(cpu, busiest);
+    int imbalance = runqueues[busiest].nr_running.load(std::memory_order_relaxed) -
+                    runqueues[cpu].nr_running.load(std::memory_order_relaxed);
+    if (imbalance >= 2) {
+        int moved = migrate_threads(busiest, cpu, imbalance / 2, true);
+        migrations.fetch_add(moved, std::memory_order_relaxed);
+    }
+    unlock_pair(cpu, busiest);
+}
+
+/**
+ * Вызывается перед началом работы, в отличие от
+ * однопроцессорного варианта заранее получает число CPU и
+ * верхнюю границу идентификаторов потоков: массив слотов
+ * общий для всех CPU и после setup не перевыделяется.
+ **/
+void scheduler_setup(int cpus, int timeslice, int max_threads)
+{
+    cpus_count = cpus < SMP_MAX_CPUS ? cpus : SMP_MAX_CPUS;
+    max_timeslice = timeslice;
+    threads.assign(max_threads, ThreadSlot{-1, -1, 0, 0, 0});
+    for (int cpu = 0; cpu < cpus_count; cpu++) {
+        CpuRunqueue *rq = &runqueues[cpu];
+        rq->lock.locked.store(false, std::memory_order_relaxed);
+        rq->head = -1;
+        rq->nr_running.store(0, std::memory_order_relaxed);
+        rq->clock = 0;
+        rq->next_balance = SMP_BALANCE_INTERVAL;
+    }
+    steals.store(0, std::memory_order_relaxed);
+    migrations.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * Новый поток ставится на наименее загруженный CPU.
+ **/
+void new_thread(int thread_id)
+{
+    int target = 0;
+    for (int cpu = 1; cpu < cpus_count; cpu++) {
+        if (runqueues[cpu].nr_running.load(std::memory_order_relaxed) <
+            runqueues[target].nr_running.load(std::memory_order_relaxed)) {
+            target = cpu;
+        }
+    }
+    CpuRunqueue *rq = &runqueues[target];
+    spin_lock(&rq->lock);
+    enqueue_tail(rq, target, thread_id);
+    threads[thread_id].last_run = rq->clock - SMP_CACHE_HOT_TICKS;
+    spin_unlock(&rq->lock);
+}
+
+/**
+ * Снимает с CPU исполняющийся на нем поток (exit_thread и
+ * block_thread), после чего пустой CPU пытается украсть
+ * работу.
+ **/
+void remove_current(int cpu)
+{
+    CpuRunqueue *rq = &runqueues[cpu];
+    spin_lock(&rq->lock);
+    if (rq->head != -1) {
+        int thread_id = rq->head;
+        dequeue(rq, thread_id);
+        threads[thread_id].last_run = rq->clock;
+    }
+    spin_unlock(&rq->lock);
+    steal_if_idle(cpu);
+}
+
+void exit_thread(int cpu)
+{
+    remove_current(cpu);
+}
+
+void block_thread(int cpu)
+{
+    remove_current(cpu);
+}
+
+/**
+ * Поток просыпается на CPU, где исполнялся последний раз,
+ * пока его данные еще могут быть в кеше этого CPU.
+ **/
+void wake_thread(int thread_id)
+{
+    int cpu = threads[thread_id].cpu;
+    CpuRunqueue *rq = &runqueues[cpu];
+    spin_lock(&rq->lock);
+    enqueue_tail(rq, cpu, thread_id);
+    spin_unlock(&rq->lock);
+}
+
+void timer_tick(int cpu)
+{
+    CpuRunqueue *rq = &runqueues[cpu];
+    spin_lock(&rq->lock);
+    rq->clock++;
+    if (rq->head != -1) {
+        ThreadSlot& slot = threads[rq->head];
+        slot.used++;
+        if (slot.used >= max_timeslice) {
+            slot.used = 0;
+            slot.last_run = rq->clock;
+            rq->head = slot.next;
+        }
+    }
+    bool balance = rq->clock >= rq->next_balance;
+    if (balance) {
+        rq->next_balance = rq->clock + SMP_BALANCE_INTERVAL;
+    }
+    spin_unlock(&rq->lock);
+
+    if (balance) {
+        load_balance(cpu);
+    }
+    steal_if_idle(cpu);
+}
+
+int current_thread(int cpu)
+{
+    CpuRunqueue *rq = &runqueues[cpu];
+    spin_lock(&rq->lock);
+    int thread_id = rq->head;
+    spin_unlock(&rq->lock);
+    return thread_id;
+}
+
+#ifdef ROUND_ROBIN_SMP_BENCH
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <random>
+
+/**
+ * Каждый CPU гоняет свой поток ОС: тики, блокировки и
+ * пробуждения из общего списка заблокированных. В конце
+ * проверяется, что каждый поток стоит ровно в одной очереди
+ * или заблокирован.
+ * Сборка: g++ -O2 -DROUND_ROBIN_SMP_BENCH round_robin/round_robin_smp.cpp -lpthread
+ * Запуск: ./a.out [cpus] [threads] [ticks per cpu]
+ **/
+int main(int argc, char const *argv[])
+{
+    int cpus = argc > 1 ? std::atoi(argv[1]) : 4;
+    int threads_count = argc > 2 ? std::atoi(argv[2]) : 256;
+    long long ticks = argc > 3 ? std::atoll(argv[3]) : 2000000;
+
+    scheduler_setup(cpus, 4, threads_count);
+    for (int thread_id = 0; thread_id < threads_count; thread_id++) {
+        new_thread(thread_id);
+    }
+
+    std::mutex blocked_lock;
+    std::vector<int> blocked;
+    std::vector<long long> busy_ticks(cpus, 0);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int cpu = 0; cpu < cpus; cpu++) {
+        workers.emplace_back([&, cpu]() {
+            std::mt19937 rng(cpu);
+            // Первый CPU блокирует потоки чаще, чтобы нагрузка была неравномерной
+            unsigned block_rate = cpu == 0 ? 4 : 16;
+            for (long long tick = 0; tick < ticks; tick++) {
+                if (current_thread(cpu) != -1) {
+                    busy_ticks[cpu]++;
+                }
+                timer_tick(cpu);
+                unsigned event = rng() % block_rate;
+                if (event == 0) {
+                    std::lock_guard<std::mutex> guard(blocked_lock);
+                    int thread_id = current_thread(cpu);
+                    if (thread_id != -1) {
+                        block_thread(cpu);
+                        blocked.push_back(thread_id);
+                    }
+                } else if (event == 1 && cpu != 0) {
+                    std::lock_guard<std::mutex> guard(blocked_lock);
+                    if (!blocked.empty()) {
+                        std::size_t index = rng() % blocked.size();
+                        wake_thread(blocked[index]);
+                        blocked[index] = blocked.back();
+                        blocked.pop_back();
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    std::vector<int> seen(threads_count, 0);
+    for (int cpu = 0; cpu < cpus; cpu++) {
+        int head = runqueues[cpu].head;
+        if (head == -1) {
+            continue;
+        }
+        int thread_id = head;
+        do {
+            seen[thread_id]++;
+            thread_id = threads[thread_id].next;
+        } while (thread_id != head);
+    }
+    for (int thread_id : blocked) {
+        seen[thread_id]++;
+    }
+    bool consistent = true;
+    for (int count : seen) {
+        consistent = consistent && count == 1;
+    }
+
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    std::printf("cpus %d, threads %d: %.2f ns/tick per cpu, steals %lld, migrations %lld, state %s\n",
+                cpus, threads_count, ns / ticks, steals.load(), migrations.load(),
+                consistent ? "consistent" : "BROKEN");
+    for (int cpu = 0; cpu < cpus; cpu++) {
+        std::printf("  cpu %d busy %.1f%%, runqueue %d\n", cpu, 100.0 * busy_ticks[cpu] / ticks,
+                    runqueues[cpu].nr_running.load());
+    }
+    return consistent ? 0 : 1;
+}
+#endif
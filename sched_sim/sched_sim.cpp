@@ -0,0 +1,512 @@
+// Детерминированный симулятор планировщика из round_robin: гоняет модели
+// нагрузки или записанные в файл трассы событий new_thread/block_thread/
+// wake_thread/exit_thread/timer_tick и считает время ожидания потоков,
+// перцентили времени отклика, переключения контекста и индекс справедливости.
+//
+// Сборка (из корня репозитория):
+//   g++ -O2 -std=c++17 sched_sim/sched_sim.cpp -o sched_sim
+//
+// Планировщик подключается как исходник в namespace, как в alloc_bench.
+// Все стандартные заголовки, которые он использует, подключены здесь заранее.
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace rr {
+#include "../round_robin/round_robin.cpp"
+}
+
+// Событие трассы:
+//   'n' - new_thread(arg), 'w' - wake_thread(arg),
+//   'b' - block_thread(), 'e' - exit_thread() для потока arg (-1 - для
+//         текущего, так записаны старые трассы),
+//   't' - arg вызовов timer_tick подряд
+struct TraceEvent {
+    char type;
+    int arg;
+};
+
+struct Trace {
+    std::string name;
+    std::vector<TraceEvent> events;
+};
+
+struct Policy {
+    const char* name;
+    rr::SchedulerMode mode;
+};
+
+const Policy POLICIES[] = {
+    {"rr", rr::SchedulerMode::RoundRobin},
+    {"mlfq", rr::SchedulerMode::Mlfq},
+    {"fair", rr::SchedulerMode::FairShare},
+};
+
+enum ThreadState { ThreadAbsent, ThreadRunnable, ThreadBlocked, ThreadExited };
+
+struct ThreadStats {
+    ThreadState state;
+    long long runnable_since;  // когда поток последний раз стал готовым
+    long long runnable_ticks;  // сколько всего был готов (в том числе исполнялся)
+    long long run_ticks;       // сколько тиков исполнялся
+    long long response_start;  // ждет первого тика после new/wake, иначе -1
+    ThreadState pending_leave; // block/exit, отложенный до попадания на CPU, иначе ThreadAbsent
+};
+
+// Прогоняет события через планировщик и параллельно следит за состоянием
+// потоков, чтобы считать метрики. block/exit из трассы относятся к своему
+// потоку при любой политике: если при проигрывании он не на CPU, событие
+// откладывается до тика, на котором он туда попадет (так же уходит с CPU
+// поток в моделях нагрузки). wake потока с отложенным block отменяет block:
+// IO закончилось, пока поток ждал CPU. Остальные невозможные события
+// (например, wake незаблокированного потока) пропускаются.
+class Simulator
+{
+public:
+    Simulator(const Policy& policy, int timeslice, Trace* record)
+        : record_(record), now_(0), last_running_(-1), context_switches_(0), idle_ticks_(0), skipped_(0), events_(0)
+    {
+        rr::scheduler_set_mode(policy.mode);
+        rr::scheduler_setup(timeslice);
+    }
+
+    void apply(const TraceEvent& event)
+    {
+        switch (event.type) {
+        case 'n':
+            new_thread(event.arg);
+            break;
+        case 'w':
+            wake(event.arg);
+            break;
+        case 'b':
+            leave(event.arg, ThreadBlocked);
+            break;
+        case 'e':
+            leave(event.arg, ThreadExited);
+            break;
+        case 't':
+            for (int i = 0; i < event.arg; i++) {
+                tick();
+            }
+            break;
+        default:
+            skipped_++;
+        }
+    }
+
+    void new_thread(int thread_id)
+    {
+        if (thread_id < 0 || (static_cast<std::size_t>(thread_id) < stats_.size() && stats_[thread_id].state != ThreadAbsent)) {
+            skipped_++;
+            return;
+        }
+        if (static_cast<std::size_t>(thread_id) >= stats_.size()) {
+            stats_.resize(thread_id + 1, ThreadStats{ThreadAbsent, 0, 0, 0, -1, ThreadAbsent});
+        }
+        make_runnable(thread_id);
+        record('n', thread_id);
+        rr::new_thread(thread_id);
+    }
+
+    void wake(int thread_id)
+    {
+        if (thread_id >= 0 && static_cast<std::size_t>(thread_id) < stats_.size() &&
+            stats_[thread_id].pending_leave == ThreadBlocked) {
+            stats_[thread_id].pending_leave = ThreadAbsent;
+            return;
+        }
+        if (thread_id < 0 || static_cast<std::size_t>(thread_id) >= stats_.size() || stats_[thread_id].state != ThreadBlocked) {
+            skipped_++;
+            return;
+        }
+        make_runnable(thread_id);
+        record('w', thread_id);
+        rr::wake_thread(thread_id);
+    }
+
+    // block_thread или exit_thread потока из трассы: сразу, если он на CPU,
+    // иначе когда он туда попадет
+    void leave(int thread_id, ThreadState state)
+    {
+        if (thread_id == -1 || thread_id == rr::current_thread()) {
+            leave_cpu(state);
+            return;
+        }
+        if (thread_id < 0 || static_cast<std::size_t>(thread_id) >= stats_.size() ||
+            stats_[thread_id].state != ThreadRunnable || stats_[thread_id].pending_leave != ThreadAbsent) {
+            skipped_++;
+            return;
+        }
+        stats_[thread_id].pending_leave = state;
+    }
+
+    // block_thread или exit_thread текущего потока
+    void leave_cpu(ThreadState state)
+    {
+        int thread_id = rr::current_thread();
+        if (thread_id == -1) {
+            skipped_++;
+            return;
+        }
+        ThreadStats& stats = stats_[thread_id];
+        stats.runnable_ticks += now_ - stats.runnable_since;
+        stats.state = state;
+        stats.response_start = -1;
+        stats.pending_leave = ThreadAbsent;
+        if (state == ThreadBlocked) {
+            record('b', thread_id);
+            rr::block_thread();
+        } else {
+            record('e', thread_id);
+            rr::exit_thread();
+        }
+    }
+
+    // Возвращает поток, которому достался тик, или -1
+    int tick()
+    {
+        int thread_id = rr::current_thread();
+        while (thread_id != -1 && stats_[thread_id].pending_leave != ThreadAbsent) {
+            leave_cpu(stats_[thread_id].pending_leave);
+            thread_id = rr::current_thread();
+        }
+        if (thread_id == -1) {
+            idle_ticks_++;
+        } else {
+            ThreadStats& stats = stats_[thread_id];
+            stats.run_ticks++;
+            if (stats.response_start >= 0) {
+                response_ticks_.push_back(static_cast<std::uint32_t>(now_ - stats.response_start));
+                stats.response_start = -1;
+            }
+            if (last_running_ != -1 && last_running_ != thread_id) {
+                context_switches_++;
+            }
+            last_running_ = thread_id;
+        }
+        // Подряд идущие тики в записи сливаются в один 't <n>'
+        if (record_ != nullptr) {
+            if (!record_->events.empty() && record_->events.back().type == 't') {
+                record_->events.back().arg++;
+            } else {
+                record_->events.push_back({'t', 1});
+            }
+        }
+        events_++;
+        now_++;
+        rr::timer_tick();
+        return thread_id;
+    }
+
+    void report(const char* policy, int timeslice, double seconds)
+    {
+        std::vector<std::uint32_t> waits;
+        double share_sum = 0.0;
+        double share_squares = 0.0;
+        std::size_t threads_count = 0;
+        for (ThreadStats& stats : stats_) {
+            if (stats.state == ThreadRunnable) {
+                stats.runnable_ticks += now_ - stats.runnable_since;
+                stats.runnable_since = now_;
+            }
+            if (stats.state == ThreadAbsent || stats.runnable_ticks == 0) {
+                continue;
+            }
+            waits.push_back(static_cast<std::uint32_t>(stats.runnable_ticks - stats.run_ticks));
+            // Доля времени готовности, которую поток действительно исполнялся
+            double share = static_cast<double>(stats.run_ticks) / stats.runnable_ticks;
+            share_sum += share;
+            share_squares += share * share;
+            threads_count++;
+        }
+        double jain = share_squares == 0.0 ? 1.0 : share_sum * share_sum / (threads_count * share_squares);
+        double mean_wait = 0.0;
+        for (std::uint32_t wait : waits) {
+            mean_wait += wait;
+        }
+        mean_wait = waits.empty() ? 0.0 : mean_wait / waits.size();
+        std::sort(waits.begin(), waits.end());
+        std::sort(response_ticks_.begin(), response_ticks_.end());
+
+        std::printf("  %-4s ts %-4d %6.1f Mev/s  ctx switches %8lld  idle %5.1f%%  wait/thread mean %9.0f max %9u"
+                    "  response p50/p90/p99/max %5u/%6u/%7u/%7u  jain %.3f",
+                    policy, timeslice, events_ / seconds / 1e6, context_switches_,
+                    now_ == 0 ? 0.0 : 100.0 * idle_ticks_ / now_,
+                    mean_wait, waits.empty() ? 0u : waits.back(),
+                    percentile(response_ticks_, 0.5), percentile(response_ticks_, 0.9),
+                    percentile(response_ticks_, 0.99), percentile(response_ticks_, 1.0), jain);
+        if (skipped_ != 0) {
+            std::printf("  skipped %lld", skipped_);
+        }
+        std::printf("\n");
+    }
+
+    void report_threads() const
+    {
+        std::printf("    thread      run  runnable      wait\n");
+        for (std::size_t thread_id = 0; thread_id < stats_.size(); thread_id++) {
+            const ThreadStats& stats = stats_[thread_id];
+            if (stats.state == ThreadAbsent) {
+                continue;
+            }
+            std::printf("    %6zu %8lld  %8lld  %8lld\n", thread_id, stats.run_ticks, stats.runnable_ticks,
+                        stats.runnable_ticks - stats.run_ticks);
+        }
+    }
+
+    int current() const { return rr::current_thread(); }
+
+private:
+    static std::uint32_t percentile(const std::vector<std::uint32_t>& sorted, double p)
+    {
+        if (sorted.empty()) {
+            return 0;
+        }
+        return sorted[static_cast<std::size_t>(p * (sorted.size() - 1))];
+    }
+
+    void make_runnable(int thread_id)
+    {
+        ThreadStats& stats = stats_[thread_id];
+        stats.state = ThreadRunnable;
+        stats.runnable_since = now_;
+        stats.response_start = now_;
+        events_++;
+    }
+
+    void record(char type, int arg)
+    {
+        if (record_ != nullptr) {
+            record_->events.push_back({type, arg});
+        }
+    }
+
+    Trace* record_;
+    std::vector<ThreadStats> stats_;
+    std::vector<std::uint32_t> response_ticks_;
+    long long now_;
+    int last_running_;
+    long long context_switches_;
+    long long idle_ticks_;
+    long long skipped_;
+    long long events_;
+};
+
+// Модель нагрузки: поток чередует отрезки счета (burst) и ожидания IO.
+// У каждого потока свой генератор, засеянный от (seed, id), поэтому при любой
+// политике и кванте потоки просят одни и те же отрезки - сравнение честное.
+struct Workload {
+    const char* name;
+    double cpu_bound_fraction;  // доля потоков, которые никогда не блокируются
+    double burst_mean;          // средняя длина отрезка счета, тиков
+    double io_mean;             // среднее время ожидания IO, тиков
+    int lifetime_bursts;        // через столько отрезков поток завершается (0 - никогда)
+};
+
+const Workload WORKLOADS[] = {
+    {"cpu-bound", 1.0, 0, 0, 0},
+    {"interactive", 0.0, 2, 400, 0},
+    {"mixed", 0.0625, 2, 400, 0},
+    {"churn", 0.0, 20, 2000, 8},
+};
+
+struct ModelThread {
+    std::mt19937 rng;
+    bool cpu_bound;
+    int remaining;
+    int bursts_left;
+};
+
+int draw_ticks(std::mt19937& rng, double mean)
+{
+    std::exponential_distribution<double> distribution(1.0 / mean);
+    return 1 + static_cast<int>(distribution(rng));
+}
+
+void run_workload(const Workload& workload, int threads_count, long long ticks, unsigned seed, Simulator* sim)
+{
+    std::vector<ModelThread> model;
+    typedef std::pair<long long, int> Wakeup;
+    std::priority_queue<Wakeup, std::vector<Wakeup>, std::greater<Wakeup>> wakeups;
+    int live_threads = 0;
+
+    auto spawn = [&](int thread_id) {
+        ModelThread thread;
+        thread.rng.seed(seed * 7919u + thread_id);
+        thread.cpu_bound = thread_id < workload.cpu_bound_fraction * threads_count;
+        thread.remaining = thread.cpu_bound ? 0 : draw_ticks(thread.rng, workload.burst_mean);
+        thread.bursts_left = workload.lifetime_bursts;
+        model.push_back(thread);
+        live_threads++;
+        sim->new_thread(thread_id);
+    };
+
+    for (int thread_id = 0; thread_id < threads_count; thread_id++) {
+        spawn(thread_id);
+    }
+    for (long long now = 0; now < ticks; now++) {
+        while (!wakeups.empty() && wakeups.top().first <= now) {
+            sim->wake(wakeups.top().second);
+            wakeups.pop();
+        }
+        // Завершившиеся потоки сменяются новыми
+        while (workload.lifetime_bursts != 0 && live_threads < threads_count) {
+            spawn(static_cast<int>(model.size()));
+        }
+        // Поток, досчитавший отрезок, уходит с CPU, как только оказывается на нем.
+        // Раньше нельзя: тик, на котором отрезок закончился, мог сразу сменить
+        // текущий поток по истечении кванта
+        for (int thread_id = sim->current(); thread_id != -1 && model[thread_id].remaining == 0; thread_id = sim->current()) {
+            ModelThread& thread = model[thread_id];
+            if (thread.bursts_left != 0 && --thread.bursts_left == 0) {
+                sim->leave_cpu(ThreadExited);
+                live_threads--;
+                continue;
+            }
+            thread.remaining = draw_ticks(thread.rng, workload.burst_mean);
+            wakeups.push(Wakeup(now + draw_ticks(thread.rng, workload.io_mean), thread_id));
+            sim->leave_cpu(ThreadBlocked);
+        }
+        int thread_id = sim->tick();
+        if (thread_id != -1 && !model[thread_id].cpu_bound) {
+            model[thread_id].remaining--;
+        }
+    }
+}
+
+// Формат файла: по событию на строку, "n <id>", "w <id>", "b <id>", "e <id>"
+// или "t <count>". В старых трассах у "b" и "e" нет id - они относятся к
+// текущему потоку.
+bool load_trace(const char* path, Trace* trace)
+{
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    trace->name = path;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string type;
+        if (!(fields >> type)) {
+            continue;
+        }
+        TraceEvent event = {type[0], -1};
+        if (!(fields >> event.arg) && event.type != 'b' && event.type != 'e') {
+            event.arg = 0;
+        }
+        trace->events.push_back(event);
+    }
+    return true;
+}
+
+void save_trace(const Trace& trace, const std::string& path)
+{
+    std::ofstream file(path);
+    for (const TraceEvent& event : trace.events) {
+        file << event.type << " " << event.arg << "\n";
+    }
+}
+
+std::vector<int> parse_list(const std::string& list)
+{
+    std::vector<int> values;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        values.push_back(std::atoi(item.c_str()));
+    }
+    return values;
+}
+
+int main(int argc, char const *argv[])
+{
+    int threads_count = 64;
+    long long ticks = 2000000;
+    unsigned seed = 1;
+    std::vector<int> timeslices = {2, 8, 32};
+    std::string policy_filter;
+    std::string save_prefix;
+    bool per_thread = false;
+    const char* trace_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            threads_count = std::atoi(argv[++i]);
+        } else if (arg == "--ticks" && i + 1 < argc) {
+            ticks = std::atoll(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = static_cast<unsigned>(std::atoi(argv[++i]));
+        } else if (arg == "--timeslices" && i + 1 < argc) {
+            timeslices = parse_list(argv[++i]);
+        } else if (arg == "--policy" && i + 1 < argc) {
+            policy_filter = argv[++i];
+        } else if (arg == "--save" && i + 1 < argc) {
+            save_prefix = argv[++i];
+        } else if (arg == "--per-thread") {
+            per_thread = true;
+        } else if (arg[0] != '-') {
+            trace_path = argv[i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--threads n] [--ticks n] [--seed n] [--timeslices a,b,c]"
+                      << " [--policy rr|mlfq|fair] [--save prefix] [--per-thread] [trace-file]\n";
+            return 1;
+        }
+    }
+
+    Trace loaded;
+    if (trace_path != nullptr && !load_trace(trace_path, &loaded)) {
+        std::cerr << "Cannot read trace " << trace_path << "\n";
+        return 1;
+    }
+
+    std::size_t runs = trace_path != nullptr ? 1 : sizeof(WORKLOADS) / sizeof(WORKLOADS[0]);
+    for (std::size_t run = 0; run < runs; run++) {
+        if (trace_path != nullptr) {
+            std::printf("Trace %s: %zu events\n", loaded.name.c_str(), loaded.events.size());
+        } else {
+            std::printf("Workload %s: %d threads, %lld ticks\n", WORKLOADS[run].name, threads_count, ticks);
+        }
+        bool saved = false;
+        for (const Policy& policy : POLICIES) {
+            if (!policy_filter.empty() && policy_filter != policy.name) {
+                continue;
+            }
+            for (int timeslice : timeslices) {
+                // Записываем трассу первого прогона модели, ее можно проиграть снова
+                Trace recorded;
+                bool record = trace_path == nullptr && !save_prefix.empty() && !saved;
+                Simulator sim(policy, timeslice, record ? &recorded : nullptr);
+                auto start = std::chrono::steady_clock::now();
+                if (trace_path != nullptr) {
+                    for (const TraceEvent& event : loaded.events) {
+                        sim.apply(event);
+                    }
+                } else {
+                    run_workload(WORKLOADS[run], threads_count, ticks, seed, &sim);
+                }
+                auto end = std::chrono::steady_clock::now();
+                sim.report(policy.name, timeslice, std::chrono::duration<double>(end - start).count());
+                if (per_thread) {
+                    sim.report_threads();
+                }
+                if (record) {
+                    save_trace(recorded, save_prefix + WORKLOADS[run].name + ".trace");
+                    saved = true;
+                }
+            }
+        }
+    }
+    return 0;
+}
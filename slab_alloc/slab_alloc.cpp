@@ -1,354 +1,2026 @@
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <new>
+#include <sched.h>
+#include <sys/mman.h>
+#include <thread>
 
 static size_t PAGE_SIZE = 4096;
+static const size_t CACHE_LINE_SIZE = 64;
 
 /**
- * Эти две функции вы должны использовать для аллокации
- * и освобождения памяти в этом задании. Считайте, что
- * внутри они используют buddy аллокатор с размером
- * страницы равным 4096 байтам.
- **/
-
-/**
- * Аллоцирует участок размером 4096 * 2^order байт,
- * выровненный на границу 4096 * 2^order байт. order
- * должен быть в интервале [0; 10] (обе границы
- * включительно), т. е. вы не можете аллоцировать больше
- * 4Mb за раз.
+ * Простая спин-блокировка: ее можно инициализировать прямо
+ * в cache_setup без конструктора, а под ней держатся только
+ * короткие операции со списками.
  **/
-void *alloc_slab(int order)
+struct spinlock
 {
-    size_t size = PAGE_SIZE * (1 << order);
-    return aligned_alloc(size, size);
-}
+    std::atomic<bool> locked;
+};
 
-/**
- * Освобождает участок ранее аллоцированный с помощью
- * функции alloc_slab.
- **/
-void free_slab(void *slab) { std::free(slab); }
+void spin_lock_init(spinlock *lock) { lock->locked.store(false, std::memory_order_relaxed); }
 
-struct slab_object_header
+void spin_lock(spinlock *lock)
 {
-    slab_object_header *next_object;
-};
+    while (lock->locked.exchange(true, std::memory_order_acquire))
+    {
+        while (lock->locked.load(std::memory_order_relaxed))
+        {
+            std::this_thread::yield();
+        }
+    }
+}
 
-struct slab_header
-{
-    // Двусвязный список для эффективного удаления и добавления в разные списки slab-ов
-    slab_header *next;
-    slab_header *prev;
-    slab_object_header *next_free_object;
-    size_t free_slabs_count;
-};
+void spin_unlock(spinlock *lock) { lock->locked.store(false, std::memory_order_release); }
+
+bool spin_trylock(spinlock *lock) { return !lock->locked.exchange(true, std::memory_order_acquire); }
 
 /**
- * Эта структура представляет аллокатор, вы можете менять
- * ее как вам удобно. Приведенные в ней поля и комментарии
- * просто дают общую идею того, что вам может понадобится
- * сохранить в этой структуре.
+ * Buddy аллокатор страниц, на котором работают alloc_slab и
+ * free_slab. Вся память - одна арена BUDDY_ARENA_SIZE байт,
+ * которая один раз берется через mmap и выравнивается на
+ * блок максимального порядка, поэтому каждый блок выровнен
+ * на свой размер. У каждого порядка свой двусвязный список
+ * свободных блоков (ссылки лежат в самих блоках) и битмап:
+ * бит стоит, если блок с этого номера страницы свободен и
+ * лежит в списке этого порядка. По битмапу free за O(1)
+ * проверяет, можно ли слиться с соседом (buddy).
  **/
-struct cache
-{
-    slab_header *empty_slabs;
-    slab_header *active_slabs;
-    slab_header *full_slabs;
+static const int BUDDY_PAGE_SHIFT = 12; /* страница 4096 байт, как PAGE_SIZE */
+static const int BUDDY_MAX_ORDER = 10;
+static const size_t BUDDY_ARENA_SIZE = size_t(256) << 20;
+static const size_t BUDDY_PAGES = BUDDY_ARENA_SIZE >> BUDDY_PAGE_SHIFT;
+static const size_t BUDDY_MAX_BLOCK = size_t(1) << (BUDDY_PAGE_SHIFT + BUDDY_MAX_ORDER);
 
-    size_t object_size;  /* размер аллоцируемого объекта */
-    int slab_order;      /* используемый размер SLAB-а */
-    size_t slab_objects; /* количество объектов в одном SLAB-е */
-    size_t slab_size;
+struct buddy_block
+{
+    buddy_block *next;
+    buddy_block *prev;
 };
 
-size_t calc_slab_objects(size_t slab_size, size_t object_size)
+uint8_t *buddy_arena = nullptr;
+buddy_block *buddy_free_lists[BUDDY_MAX_ORDER + 1];
+size_t buddy_free_counts[BUDDY_MAX_ORDER + 1];
+// Битмапы всех порядков подряд: у порядка k BUDDY_PAGES >> k бит
+uint64_t buddy_bitmap[2 * BUDDY_PAGES / 64];
+uint8_t buddy_orders[BUDDY_PAGES]; /* порядок занятого блока по номеру первой страницы */
+spinlock buddy_lock;
+std::atomic<bool> buddy_ready(false);
+
+size_t buddy_bit_index(size_t page, int order)
 {
-    return (slab_size - sizeof(slab_header)) /
-           (object_size + sizeof(slab_object_header));
+    return 2 * BUDDY_PAGES - 2 * (BUDDY_PAGES >> order) + (page >> order);
 }
 
-int calc_slab_order(size_t object_size)
+bool buddy_is_free(size_t page, int order)
 {
-    size_t slab_size = PAGE_SIZE;
-    for (int i = 0; i < 10; i++)
-    {
-        size_t objects_count = calc_slab_objects(slab_size, object_size);
-        if (objects_count >= 10)
-        {
-            break;
-        }
-        slab_size *= 2;
-    }
-    return slab_size;
+    size_t bit = buddy_bit_index(page, order);
+    return (buddy_bitmap[bit / 64] >> (bit % 64)) & 1;
 }
 
-size_t calc_slab_size(int slab_order) { return PAGE_SIZE * (1 << slab_order); }
-
-slab_header *get_slab_ptr(struct cache *cache, void *ptr)
+buddy_block *buddy_page_block(size_t page)
 {
-    uintptr_t ptr_as_int = reinterpret_cast<uintptr_t>(ptr);
-    ptr_as_int &= ~(cache->slab_size - 1);
-    return reinterpret_cast<slab_header *>(ptr_as_int);
+    return reinterpret_cast<buddy_block *>(buddy_arena + (page << BUDDY_PAGE_SHIFT));
 }
 
-slab_header *alloc_new_slab(struct cache *cache)
+void buddy_push(size_t page, int order)
 {
-    slab_header *slab = static_cast<slab_header *>(alloc_slab(cache->slab_order));
-    slab->free_slabs_count = cache->slab_objects;
-    slab->next = nullptr;
-    slab->prev = nullptr;
-
-    slab_object_header *curr_free_object = reinterpret_cast<slab_object_header *>(slab + 1);
-    slab->next_free_object = curr_free_object;
-
-    uint8_t *byte_addr = reinterpret_cast<uint8_t *>(curr_free_object);
-    for (size_t i = 1; i < cache->slab_objects; i++)
+    buddy_block *block = buddy_page_block(page);
+    block->prev = nullptr;
+    block->next = buddy_free_lists[order];
+    if (block->next != nullptr)
     {
-        byte_addr += sizeof(slab_object_header) + cache->object_size;
-        slab_object_header *next_free_object = reinterpret_cast<slab_object_header *>(byte_addr);
-        curr_free_object->next_object = next_free_object;
-        curr_free_object = next_free_object;
+        block->next->prev = block;
     }
-
-    return slab;
+    buddy_free_lists[order] = block;
+    buddy_free_counts[order]++;
+    size_t bit = buddy_bit_index(page, order);
+    buddy_bitmap[bit / 64] |= uint64_t(1) << (bit % 64);
 }
 
-void remove_slab_from_list(slab_header *slab)
+void buddy_remove(size_t page, int order)
 {
-    if (slab->prev != nullptr)
+    buddy_block *block = buddy_page_block(page);
+    if (block->prev != nullptr)
     {
-        slab->prev->next = slab->next;
+        block->prev->next = block->next;
     }
-    if (slab->next != nullptr)
+    else
     {
-        slab->next->prev = slab->prev;
+        buddy_free_lists[order] = block->next;
+    }
+    if (block->next != nullptr)
+    {
+        block->next->prev = block->prev;
     }
+    buddy_free_counts[order]--;
+    size_t bit = buddy_bit_index(page, order);
+    buddy_bitmap[bit / 64] &= ~(uint64_t(1) << (bit % 64));
 }
 
 /**
- * Вставляет slab в связанный список перед next_slab.
- */
-void add_slab_before_next_slab(slab_header *slab, slab_header *next_slab)
+ * Берет арену у ОС. Лишний блок максимального порядка
+ * нужен, чтобы выровнять начало арены.
+ **/
+bool buddy_init()
 {
-    slab->next = next_slab;
-    slab->prev = nullptr;
-    if (slab->next != nullptr)
+    void *mapping = mmap(nullptr, BUDDY_ARENA_SIZE + BUDDY_MAX_BLOCK, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED)
     {
-        slab->prev = slab->next->prev;
-        slab->next->prev = slab;
+        return false;
+    }
+    uintptr_t base = (reinterpret_cast<uintptr_t>(mapping) + BUDDY_MAX_BLOCK - 1) & ~(BUDDY_MAX_BLOCK - 1);
+    buddy_arena = reinterpret_cast<uint8_t *>(base);
+    for (size_t page = BUDDY_PAGES; page > 0; page -= size_t(1) << BUDDY_MAX_ORDER)
+    {
+        buddy_push(page - (size_t(1) << BUDDY_MAX_ORDER), BUDDY_MAX_ORDER);
     }
+    return true;
 }
 
 /**
- * Функция инициализации будет вызвана перед тем, как
- * использовать это кеширующий аллокатор для аллокации.
- * Параметры:
- *  - cache - структура, которую вы должны инициализировать
- *  - object_size - размер объектов, которые должен
- *    аллоцировать этот кеширующий аллокатор
+ * Аллокация и освобождение блока под buddy_lock.
  **/
-void cache_setup(struct cache *cache, size_t object_size)
+void *buddy_alloc_locked(int order)
 {
-    cache->empty_slabs = nullptr;
-    cache->active_slabs = nullptr;
-    cache->full_slabs = nullptr;
-
-    cache->object_size = object_size;
-    cache->slab_order = calc_slab_order(cache->object_size);
-    cache->slab_size = calc_slab_size(cache->slab_order);
-    cache->slab_objects = calc_slab_objects(cache->slab_size, cache->object_size);
-    std::cout << "Initialized cache: object_size = " << cache->object_size
-              << ", slab_order = " << cache->slab_order
-              << ", slab_size = " << cache->slab_size
-              << ", slab_objects = " << cache->slab_objects
-              << "\n";
+    int curr_order = order;
+    while (curr_order <= BUDDY_MAX_ORDER && buddy_free_lists[curr_order] == nullptr)
+    {
+        curr_order++;
+    }
+    if (curr_order > BUDDY_MAX_ORDER)
+    {
+        return nullptr;
+    }
+    buddy_block *block = buddy_free_lists[curr_order];
+    size_t page = (reinterpret_cast<uint8_t *>(block) - buddy_arena) >> BUDDY_PAGE_SHIFT;
+    buddy_remove(page, curr_order);
+    // Вторые половины лишнего отдаем в списки меньших порядков
+    while (curr_order > order)
+    {
+        curr_order--;
+        buddy_push(page + (size_t(1) << curr_order), curr_order);
+    }
+    buddy_orders[page] = order;
+    return block;
 }
 
-/**
- * Освобождает все slab-ы в списке, начиная с переданного slab-а
- */
-void free_cached_slabs(slab_header *slab)
+void buddy_free_locked(void *ptr)
 {
-    std::cout << "Freeing cached slabs starting from " << static_cast<void*>(slab) << "\n";
-    slab_header *curr_slab = slab;
-    while (curr_slab != nullptr)
+    size_t page = (static_cast<uint8_t *>(ptr) - buddy_arena) >> BUDDY_PAGE_SHIFT;
+    int order = buddy_orders[page];
+    while (order < BUDDY_MAX_ORDER)
     {
-        slab_header *next_slab = curr_slab->next;
-        curr_slab->next = nullptr;
-        free_slab(curr_slab);
-        std::cout << "Free " << static_cast<void*>(curr_slab) << "\n";
-        curr_slab = next_slab;
+        size_t buddy = page ^ (size_t(1) << order);
+        if (!buddy_is_free(buddy, order))
+        {
+            break;
+        }
+        buddy_remove(buddy, order);
+        page &= ~(size_t(1) << order);
+        order++;
     }
+    buddy_push(page, order);
 }
 
 /**
- * Функция освобождения будет вызвана когда работа с
- * аллокатором будет закончена. Она должна освободить
- * всю память занятую аллокатором. Проверяющая система
- * будет считать ошибкой, если не вся память будет
- * освбождена.
+ * Кеш страниц нулевого порядка у каждого потока (как per-cpu
+ * pagesets в Linux): slab-ы мелких кешей чаще всего занимают
+ * одну страницу, и за ними не нужно каждый раз ходить под
+ * buddy_lock. Страницы забираются и возвращаются пачками по
+ * BUDDY_PCP_BATCH, при выходе потока кеш возвращается в buddy.
  **/
-void cache_release(struct cache *cache)
+static const size_t BUDDY_PCP_HIGH = 32;
+static const size_t BUDDY_PCP_BATCH = 16;
+
+struct buddy_page_cache
 {
-    free_cached_slabs(cache->empty_slabs);
-    cache->empty_slabs = nullptr;
-    free_cached_slabs(cache->active_slabs);
-    cache->active_slabs = nullptr;
-    free_cached_slabs(cache->full_slabs);
-    cache->full_slabs = nullptr;
-}
+    size_t count;
+    void *pages[BUDDY_PCP_HIGH];
 
-/**
- * Возвращает slab, из которого будет производиться аллокация.
- * В приоритете берется активный slab, после чего пытается вернуться empty_slab.
- * Если нет slab-ов, то будет создан новый.
- */
-slab_header *get_slab_to_alloc(struct cache *cache)
+    ~buddy_page_cache()
+    {
+        spin_lock(&buddy_lock);
+        for (size_t i = 0; i < count; i++)
+        {
+            buddy_free_locked(pages[i]);
+        }
+        spin_unlock(&buddy_lock);
+        count = 0;
+    }
+};
+
+thread_local buddy_page_cache buddy_pcp;
+
+bool buddy_ensure_ready()
 {
-    if (cache->active_slabs != nullptr)
+    if (buddy_ready.load(std::memory_order_acquire))
     {
-        std::cout << "Getting active slab for object allocation " << static_cast<void*>(cache->active_slabs) << "\n";
-        return cache->active_slabs;
+        return true;
     }
-    if (cache->empty_slabs != nullptr)
+    spin_lock(&buddy_lock);
+    if (!buddy_ready.load(std::memory_order_relaxed) && buddy_init())
     {
-        std::cout << "Getting empty slab for object allocation " << static_cast<void*>(cache->empty_slabs) << "\n";
-        return cache->empty_slabs;
+        buddy_ready.store(true, std::memory_order_release);
     }
-    std::cout << "Allocating new slab for object allocation\n";
-    return alloc_new_slab(cache);
+    spin_unlock(&buddy_lock);
+    return buddy_ready.load(std::memory_order_acquire);
 }
 
 /**
- * Функция аллокации памяти из кеширующего аллокатора.
- * Должна возвращать указатель на участок памяти размера
- * как минимум object_size байт (см cache_setup).
- * Гарантируется, что cache указывает на корректный
- * инициализированный аллокатор.
+ * Эти две функции вы должны использовать для аллокации
+ * и освобождения памяти в этом задании. Внутри они
+ * используют buddy аллокатор выше с размером страницы
+ * равным 4096 байтам.
  **/
-void *cache_alloc(struct cache *cache)
-{
-    std::cout << "Allocating new object\n";
-    slab_header *slab = get_slab_to_alloc(cache);
-    std::cout << "Allocated slab for object: " << static_cast<void*>(slab) << " with empty objects count " << slab->free_slabs_count << "\n";
-    slab_object_header *free_object = slab->next_free_object;
-
-    slab->next_free_object = free_object->next_object;
-    bool was_empty_slab = slab->free_slabs_count == cache->slab_objects;
 
-    if (was_empty_slab)
+/**
+ * Аллоцирует участок размером 4096 * 2^order байт,
+ * выровненный на границу 4096 * 2^order байт. order
+ * должен быть в интервале [0; 10] (обе границы
+ * включительно), т. е. вы не можете аллоцировать больше
+ * 4Mb за раз. Если арена закончилась, возвращает nullptr.
+ **/
+void *alloc_slab(int order)
+{
+    if (!buddy_ensure_ready())
     {
-        // Перестали быть пустыми
-        remove_slab_from_list(slab);
-        std::cout << "Removed slab from empty list\n";
-        if (cache->empty_slabs == slab)
-        {
-            // мы первый элемент - двигаем список
-            cache->empty_slabs = slab->next;
-            std::cout << "Empty slab was start of list - remove from cached head\n";
-        }
+        return nullptr;
+    }
+    if (order != 0)
+    {
+        spin_lock(&buddy_lock);
+        void *block = buddy_alloc_locked(order);
+        spin_unlock(&buddy_lock);
+        return block;
     }
 
-    slab->free_slabs_count--;
-    if (slab->free_slabs_count == 0)
+    buddy_page_cache *pcp = &buddy_pcp;
+    if (pcp->count == 0)
     {
-        std::cout << "Slab became full\n";
-        // стали полностью заполненными
-        if (!was_empty_slab)
+        spin_lock(&buddy_lock);
+        while (pcp->count < BUDDY_PCP_BATCH)
         {
-            // перестали быть частично заполнеными
-            remove_slab_from_list(slab);
-            std::cout << "Allocating slab from active list\n";
-            if (cache->active_slabs == slab)
+            void *page = buddy_alloc_locked(0);
+            if (page == nullptr)
             {
-                // мы первый элемент - двигаем список
-                cache->active_slabs = slab->next;
-                std::cout << "Active slab was start of list - remove from cached head\n";
+                break;
             }
+            pcp->pages[pcp->count++] = page;
+        }
+        spin_unlock(&buddy_lock);
+        if (pcp->count == 0)
+        {
+            return nullptr;
         }
-        add_slab_before_next_slab(slab, cache->full_slabs);
-        cache->full_slabs = slab;
-    } else if (was_empty_slab) {
-        // Стали именно активными
-        add_slab_before_next_slab(slab, cache->active_slabs);
-        cache->active_slabs = slab;
     }
-
-    return free_object + 1;
+    return pcp->pages[--pcp->count];
 }
 
 /**
- * Функция освобождения памяти назад в кеширующий аллокатор.
- * Гарантируется, что ptr - указатель ранее возвращенный из
- * cache_alloc.
+ * Освобождает участок ранее аллоцированный с помощью
+ * функции alloc_slab.
  **/
-void cache_free(struct cache *cache, void *ptr)
+void free_slab(void *slab)
 {
-    // ptr указывает на свободную память, значит нужно сдвинуться назад на размер
-    // хедера
-    slab_object_header *slab_object = static_cast<slab_object_header *>(ptr) - 1;
-
-    slab_header *slab = get_slab_ptr(cache, ptr);
-    slab_object->next_object = slab->next_free_object;
-    slab->next_free_object = slab_object;
-
-    bool was_full = slab->free_slabs_count == 0;
-    slab->free_slabs_count++;
+    size_t page = (static_cast<uint8_t *>(slab) - buddy_arena) >> BUDDY_PAGE_SHIFT;
+    if (buddy_orders[page] != 0)
+    {
+        spin_lock(&buddy_lock);
+        buddy_free_locked(slab);
+        spin_unlock(&buddy_lock);
+        return;
+    }
 
-    if (was_full)
+    buddy_page_cache *pcp = &buddy_pcp;
+    if (pcp->count == BUDDY_PCP_HIGH)
     {
-        // были полностью заняты
-        remove_slab_from_list(slab);
-        if (cache->full_slabs == slab)
+        spin_lock(&buddy_lock);
+        while (pcp->count > BUDDY_PCP_HIGH - BUDDY_PCP_BATCH)
         {
-            // мы первый элемент - двигаем список
-            cache->full_slabs = slab->next;
+            buddy_free_locked(pcp->pages[--pcp->count]);
         }
+        spin_unlock(&buddy_lock);
     }
+    pcp->pages[pcp->count++] = slab;
+}
 
-    if (slab->free_slabs_count == cache->slab_objects)
+/**
+ * Печатает, сколько свободных блоков каждого порядка
+ * лежит в buddy аллокаторе (без кешей потоков).
+ **/
+void buddy_report(std::ostream &out)
+{
+    spin_lock(&buddy_lock);
+    for (int order = 0; order <= BUDDY_MAX_ORDER; order++)
     {
-        // стали пустыми
-        if (!was_full)
-        {
-            // перестали быть частично заполнеными
-            remove_slab_from_list(slab);
-            if (cache->active_slabs == slab)
-            {
-                // мы первый элемент - двигаем список
-                cache->active_slabs = slab->next;
-            }
-        }
-        add_slab_before_next_slab(slab, cache->empty_slabs);
-        cache->empty_slabs = slab;
-    } else if (was_full) {
-        // Стали именно активными
-        add_slab_before_next_slab(slab, cache->active_slabs);
-        cache->active_slabs = slab;
+        out << "order " << order << ": " << buddy_free_counts[order] << " free blocks\n";
     }
+    spin_unlock(&buddy_lock);
 }
 
 /**
- * Функция должна освободить все SLAB, которые не содержат
- * занятых объектов. Если SLAB не использовался для аллокации
- * объектов (например, если вы выделяли с помощью alloc_slab
- * память для внутренних нужд вашего алгоритма), то освбождать
- * его не обязательно.
+ * Трассировка событий аллокатора. По умолчанию выключена и
+ * ничего не стоит: trace_event компилируется в пустую функцию.
+ * При сборке с -DSLAB_TRACE=1 события пишутся в кольцевой
+ * буфер без блокировок, а по каждому типу ведется счетчик.
+ * Посмотреть и то, и другое можно через slab_trace_dump.
  **/
-void cache_shrink(struct cache *cache)
+#ifndef SLAB_TRACE
+#define SLAB_TRACE 0
+#endif
+
+enum slab_event
 {
-    free_cached_slabs(cache->empty_slabs);
-    cache->empty_slabs = nullptr;
+    EVENT_CACHE_SETUP,    /* value - размер объекта */
+    EVENT_SLAB_CREATED,   /* value - цвет slab-а */
+    EVENT_SLAB_FREED,
+    EVENT_SLAB_TO_ACTIVE, /* переходы slab-а между списками */
+    EVENT_SLAB_TO_FULL,
+    EVENT_SLAB_TO_EMPTY,
+    EVENT_SHRINK_RECLAIM, /* value - сколько slab-ов вернул cache_shrink */
+    EVENT_COUNT
+};
+
+static const char *const slab_event_names[EVENT_COUNT] = {
+    "cache_setup", "slab_created", "slab_freed", "slab_to_active",
+    "slab_to_full", "slab_to_empty", "shrink_reclaim"};
+
+struct cache;
+
+#if SLAB_TRACE
+static const size_t TRACE_RING_SIZE = 4096; /* степень двойки */
+
+/**
+ * Запись защищена как seqlock: писатель обнуляет seq, пишет
+ * поля и публикует seq последним, а читатель перечитывает
+ * seq после полей. Поля атомарные (relaxed), чтобы чтение
+ * записи, которую в этот момент перезаписывают, не было
+ * гонкой данных.
+ **/
+struct trace_entry
+{
+    std::atomic<uint64_t> seq; /* номер записи + 1, пишется последним */
+    std::atomic<slab_event> event;
+    std::atomic<const struct cache *> cache;
+    std::atomic<const void *> ptr;
+    std::atomic<size_t> value;
+};
+
+trace_entry trace_ring[TRACE_RING_SIZE];
+std::atomic<uint64_t> trace_head(0);
+std::atomic<uint64_t> trace_counters[EVENT_COUNT];
+#endif
+
+inline void trace_event(slab_event event, const struct cache *cache, const void *ptr, size_t value)
+{
+#if SLAB_TRACE
+    trace_counters[event].fetch_add(1, std::memory_order_relaxed);
+    uint64_t seq = trace_head.fetch_add(1, std::memory_order_relaxed);
+    trace_entry *entry = &trace_ring[seq & (TRACE_RING_SIZE - 1)];
+    entry->seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    entry->event.store(event, std::memory_order_relaxed);
+    entry->cache.store(cache, std::memory_order_relaxed);
+    entry->ptr.store(ptr, std::memory_order_relaxed);
+    entry->value.store(value, std::memory_order_relaxed);
+    entry->seq.store(seq + 1, std::memory_order_release);
+#else
+    (void)event;
+    (void)cache;
+    (void)ptr;
+    (void)value;
+#endif
 }
 
-int main(int argc, char const *argv[])
+/**
+ * Печатает счетчики событий и последние last событий из
+ * кольцевого буфера. Записи, которые в этот момент
+ * перезаписываются другими потоками, пропускаются.
+ **/
+void slab_trace_dump(std::ostream &out, size_t last)
 {
-    struct cache *cache = (struct cache *)std::malloc(sizeof(struct cache));
+#if SLAB_TRACE
+    for (int event = 0; event < EVENT_COUNT; event++)
+    {
+        out << slab_event_names[event] << ": " << trace_counters[event].load(std::memory_order_relaxed) << "\n";
+    }
+    uint64_t head = trace_head.load(std::memory_order_acquire);
+    if (last > TRACE_RING_SIZE)
+    {
+        last = TRACE_RING_SIZE;
+    }
+    uint64_t first = head > last ? head - last : 0;
+    for (uint64_t seq = first; seq < head; seq++)
+    {
+        trace_entry *entry = &trace_ring[seq & (TRACE_RING_SIZE - 1)];
+        if (entry->seq.load(std::memory_order_acquire) != seq + 1)
+        {
+            continue;
+        }
+        slab_event event = entry->event.load(std::memory_order_relaxed);
+        const struct cache *cache = entry->cache.load(std::memory_order_relaxed);
+        const void *ptr = entry->ptr.load(std::memory_order_relaxed);
+        size_t value = entry->value.load(std::memory_order_relaxed);
+        // Если за время чтения слот начали перезаписывать, seq изменился
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (entry->seq.load(std::memory_order_relaxed) != seq + 1)
+        {
+            continue;
+        }
+        out << "#" << seq << " " << slab_event_names[event]
+            << " cache=" << cache << " ptr=" << ptr
+            << " value=" << value << "\n";
+    }
+#else
+    (void)last;
+    out << "slab tracing is disabled, build with -DSLAB_TRACE=1\n";
+#endif
+}
+
+/**
+ * Заголовка у объекта нет: пока объект свободен, в его
+ * первых байтах лежит указатель на следующий свободный
+ * объект slab-а, а занятый объект целиком отдан
+ * пользователю. Поэтому объект не может быть меньше
+ * указателя (см. calc_object_stride). У кешей с
+ * конструктором свободный объект должен оставаться
+ * сконструированным, и ссылка лежит сразу за объектом
+ * (см. cache_setup_ctor и free_link_offset).
+ **/
+struct slab_free_object
+{
+    slab_free_object *next_object;
+};
+
+struct slab_header
+{
+    // Двусвязный список для эффективного удаления и добавления в разные списки slab-ов
+    slab_header *next;
+    slab_header *prev;
+    slab_free_object *next_free_object; /* только уже выданные и возвращенные объекты */
+    uint8_t *bump_object;               /* первый объект, который еще ни разу не выдавали */
+    uint32_t free_slabs_count;          /* свободные объекты: свободный список + за bump_object */
+    uint32_t colour; /* номер цвета, с которым создан slab */
+    uint64_t empty_since; /* тик slab_clock, когда slab стал пустым */
+};
+
+/**
+ * Кеш, которому принадлежит каждая страница арены buddy (как
+ * page->slab_cache в Linux). Заполняется для всех страниц
+ * slab-а при его создании, поэтому по любому адресу объекта
+ * кеш находится без знания порядка slab-а (см. kfree).
+ * Записи страниц, вернувшихся в buddy, не чистятся: читать
+ * таблицу можно только по адресам живых объектов.
+ **/
+struct cache *slab_page_owner[BUDDY_PAGES];
+
+size_t slab_page_index(const void *ptr)
+{
+    return (static_cast<const uint8_t *>(ptr) - buddy_arena) >> BUDDY_PAGE_SHIFT;
+}
+
+static const int MAGAZINE_SIZE = 32;
+static const int MAGAZINE_CPUS = 64;
+
+/**
+ * Магазин (Bonwick, Adams "Magazines and Vmem") - стек из
+ * MAGAZINE_SIZE свободных объектов кеша. Магазины сами
+ * аллоцируются из отдельного кеша magazine_cache.
+ **/
+struct magazine
+{
+    magazine *next;
+    size_t rounds;
+    void *objects[MAGAZINE_SIZE];
+};
+
+/**
+ * Магазины одного CPU: из loaded берутся и в него кладутся
+ * объекты, previous позволяет не ходить в depot, когда поток
+ * колеблется около границы магазина.
+ **/
+struct cpu_magazines
+{
+    spinlock lock;
+    magazine *loaded;
+    magazine *previous;
+};
+
+/**
+ * Список магазинов в depot. min_count - самая маленькая
+ * длина списка с прошлого caches_reap: столько магазинов за
+ * весь интервал никто не взял, и их можно вернуть.
+ **/
+struct magazine_list
+{
+    magazine *head;
+    size_t count;
+    size_t min_count;
+};
+
+/**
+ * Эта структура представляет аллокатор, вы можете менять
+ * ее как вам удобно. Приведенные в ней поля и комментарии
+ * просто дают общую идею того, что вам может понадобится
+ * сохранить в этой структуре.
+ **/
+struct cache
+{
+    slab_header *empty_slabs;
+    slab_header *active_slabs;
+    slab_header *full_slabs;
+
+    size_t object_size;  /* размер аллоцируемого объекта */
+    int slab_order;      /* используемый размер SLAB-а */
+    size_t slab_objects; /* количество объектов в одном SLAB-е */
+    size_t slab_size;
+    size_t object_stride;  /* расстояние между соседними объектами в slab-е */
+    size_t objects_offset; /* смещение первого объекта от начала slab-а */
+    size_t colours;        /* количество цветов, см. alloc_new_slab */
+    size_t colour_next;    /* цвет следующего нового slab-а */
+
+    // Кеширование сконструированных объектов, см. cache_setup_ctor
+    size_t free_link_offset; /* где в свободном объекте лежит slab_free_object */
+    void (*ctor)(void *object, void *arg);
+    void (*dtor)(void *object, void *arg);
+    void *ctor_arg;
+
+    // Многопоточный режим, см. cache_alloc_mt/cache_free_mt
+    spinlock slab_lock;             /* защищает списки slab-ов */
+    spinlock depot_lock;            /* защищает depot */
+    magazine_list depot_full;       /* только полные магазины */
+    magazine_list depot_empty;
+    cpu_magazines cpus[MAGAZINE_CPUS];
+
+    // Реестр кешей и возврат памяти, см. caches_reap/slab_memory_pressure
+    struct cache *registry_next;
+    struct cache *registry_prev;
+    size_t min_empty_slabs; /* сколько пустых slab-ов caches_reap не трогает */
+};
+
+/**
+ * Глобальный реестр всех кешей (как slab_caches в Linux):
+ * cache_setup добавляет в него кеш, cache_release убирает.
+ * По нему ходят caches_reap и slab_memory_pressure.
+ **/
+static const size_t SLAB_DEFAULT_MIN_EMPTY = 1;
+static const uint64_t SLAB_REAP_AGE = 2; /* сколько тиков пустой slab живет до возврата */
+
+struct cache *cache_registry = nullptr;
+spinlock cache_registry_lock;
+std::atomic<uint64_t> slab_clock(0); /* тикает при каждом caches_reap */
+
+void cache_register(struct cache *cache)
+{
+    spin_lock(&cache_registry_lock);
+    cache->registry_prev = nullptr;
+    cache->registry_next = cache_registry;
+    if (cache_registry != nullptr)
+    {
+        cache_registry->registry_prev = cache;
+    }
+    cache_registry = cache;
+    spin_unlock(&cache_registry_lock);
+}
+
+void cache_unregister(struct cache *cache)
+{
+    spin_lock(&cache_registry_lock);
+    if (cache->registry_prev != nullptr)
+    {
+        cache->registry_prev->registry_next = cache->registry_next;
+    }
+    else
+    {
+        cache_registry = cache->registry_next;
+    }
+    if (cache->registry_next != nullptr)
+    {
+        cache->registry_next->registry_prev = cache->registry_prev;
+    }
+    spin_unlock(&cache_registry_lock);
+}
+
+/**
+ * Объекты лежат вплотную друг к другу: размер округляется
+ * вверх только до размера указателя, чтобы в свободном
+ * объекте поместилась ссылка на следующий.
+ **/
+size_t calc_object_stride(size_t object_size)
+{
+    size_t stride = object_size < sizeof(slab_free_object) ? sizeof(slab_free_object) : object_size;
+    return (stride + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+/**
+ * Естественное выравнивание объекта: наибольшая степень
+ * двойки, на которую делится stride, но не больше 16 байт
+ * (как у malloc).
+ **/
+size_t calc_object_align(size_t object_stride)
+{
+    size_t align = object_stride & (~object_stride + 1);
+    return align > 16 ? 16 : align;
+}
+
+size_t calc_objects_offset(size_t object_stride)
+{
+    size_t align = calc_object_align(object_stride);
+    return (sizeof(slab_header) + align - 1) & ~(align - 1);
+}
+
+size_t calc_slab_objects(size_t slab_size, size_t object_size)
+{
+    size_t stride = calc_object_stride(object_size);
+    return (slab_size - calc_objects_offset(stride)) / stride;
+}
+
+/**
+ * Количество цветов slab-а: сколько раз в остаток, который
+ * не поместил ни одного объекта, влезает кеш линия, плюс
+ * нулевой цвет.
+ **/
+size_t calc_slab_colours(size_t slab_size, size_t object_size)
+{
+    size_t stride = calc_object_stride(object_size);
+    size_t used = calc_objects_offset(stride) + calc_slab_objects(slab_size, object_size) * stride;
+    return (slab_size - used) / CACHE_LINE_SIZE + 1;
+}
+
+size_t calc_slab_size(int slab_order) { return PAGE_SIZE * (1 << slab_order); }
+
+static const int SLAB_MAX_ORDER = 10;          /* ограничение alloc_slab */
+static const int SLAB_PREFERRED_MAX_ORDER = 3; /* дальше 32Kb без нужды не идем */
+static const size_t SLAB_MIN_OBJECTS = 10;
+
+/**
+ * Кандидат на размер slab-а: сколько объектов в нем
+ * поместится и сколько байт останется без дела.
+ **/
+struct slab_order_candidate
+{
+    int order;
+    size_t slab_size;
+    size_t objects;
+    size_t leftover; /* байт в slab-е не занято ни заголовком, ни объектами */
+};
+
+slab_order_candidate calc_slab_order_candidate(int order, size_t object_size)
+{
+    slab_order_candidate candidate;
+    candidate.order = order;
+    candidate.slab_size = calc_slab_size(order);
+    candidate.objects = calc_slab_objects(candidate.slab_size, object_size);
+    candidate.leftover = candidate.slab_size - calc_objects_offset(calc_object_stride(object_size)) -
+                         candidate.objects * calc_object_stride(object_size);
+    return candidate;
+}
+
+/**
+ * Перебирает все порядки 0..SLAB_MAX_ORDER и выбирает тот, у
+ * которого меньше всего потерянных байт в slab-е, при
+ * условии, что в slab помещается хотя бы SLAB_MIN_OBJECTS
+ * объектов. Порядки больше SLAB_PREFERRED_MAX_ORDER
+ * рассматриваются, только если меньшие не вмещают
+ * SLAB_MIN_OBJECTS объектов, и тогда верхней границей
+ * становится первый подходящий порядок. При равных потерях
+ * берется меньший порядок: так меньше памяти держит один
+ * недозаполненный slab.
+ **/
+int calc_slab_order(size_t object_size)
+{
+    int max_order = SLAB_PREFERRED_MAX_ORDER;
+    while (max_order < SLAB_MAX_ORDER &&
+           calc_slab_objects(calc_slab_size(max_order), object_size) < SLAB_MIN_OBJECTS)
+    {
+        max_order++;
+    }
+
+    int best_order = -1;
+    size_t best_leftover = 0;
+    for (int order = 0; order <= max_order; order++)
+    {
+        slab_order_candidate candidate = calc_slab_order_candidate(order, object_size);
+        if (candidate.objects < SLAB_MIN_OBJECTS)
+        {
+            continue;
+        }
+        if (best_order < 0 || candidate.leftover < best_leftover)
+        {
+            best_order = order;
+            best_leftover = candidate.leftover;
+        }
+    }
+    // даже 4Mb не вмещает SLAB_MIN_OBJECTS объектов - берем самый большой slab
+    return best_order < 0 ? SLAB_MAX_ORDER : best_order;
+}
+
+/**
+ * Печатает таблицу потерь по всем порядкам для object_size,
+ * помечая выбранный calc_slab_order. Нужна, чтобы подбирать
+ * размеры кешей для неудобных размеров объектов.
+ **/
+void slab_order_report(std::ostream &out, size_t object_size)
+{
+    int chosen = calc_slab_order(object_size);
+    out << "object_size = " << object_size << ", stride = " << calc_object_stride(object_size) << "\n";
+    out << "  order  slab_size  objects  leftover  waste\n";
+    for (int order = 0; order <= SLAB_MAX_ORDER; order++)
+    {
+        slab_order_candidate candidate = calc_slab_order_candidate(order, object_size);
+        char line[96];
+        std::snprintf(line, sizeof(line), "  %5d  %9zu  %7zu  %8zu  %4.1f%%%s\n", candidate.order,
+                      candidate.slab_size, candidate.objects, candidate.leftover,
+                      100.0 * candidate.leftover / candidate.slab_size,
+                      order == chosen ? "  <- chosen"
+                                      : (candidate.objects < SLAB_MIN_OBJECTS ? "  (too few objects)" : ""));
+        out << line;
+    }
+}
+
+slab_header *get_slab_ptr(struct cache *cache, void *ptr)
+{
+    uintptr_t ptr_as_int = reinterpret_cast<uintptr_t>(ptr);
+    ptr_as_int &= ~(cache->slab_size - 1);
+    return reinterpret_cast<slab_header *>(ptr_as_int);
+}
+
+slab_free_object *object_link(struct cache *cache, void *object)
+{
+    return reinterpret_cast<slab_free_object *>(static_cast<uint8_t *>(object) + cache->free_link_offset);
+}
+
+void *link_object(struct cache *cache, slab_free_object *link)
+{
+    return reinterpret_cast<uint8_t *>(link) - cache->free_link_offset;
+}
+
+uint8_t *slab_first_object(struct cache *cache, slab_header *slab)
+{
+    return reinterpret_cast<uint8_t *>(slab) + cache->objects_offset + slab->colour * CACHE_LINE_SIZE;
+}
+
+/**
+ * Берет свободный объект из slab-а, в котором он точно есть:
+ * сначала из свободного списка (эти объекты недавно
+ * использовались и скорее всего в кеше процессора), потом
+ * следующий еще не выданный по bump_object. Пока
+ * free_slabs_count больше нуля, а свободный список пуст,
+ * за bump_object гарантированно есть объект, поэтому конец
+ * slab-а проверять не нужно. В кешах с конструктором
+ * объект конструируется при первой выдаче.
+ **/
+void *slab_take_object(struct cache *cache, slab_header *slab)
+{
+    slab_free_object *free_object = slab->next_free_object;
+    if (free_object != nullptr)
+    {
+        slab->next_free_object = free_object->next_object;
+        return link_object(cache, free_object);
+    }
+    uint8_t *object = slab->bump_object;
+    slab->bump_object += cache->object_stride;
+    if (cache->ctor != nullptr)
+    {
+        cache->ctor(object, cache->ctor_arg);
+    }
+    return object;
+}
+
+/**
+ * Берет новый slab у buddy. Если buddy закончился, возвращает
+ * nullptr: пустые slab-ы чужих кешей здесь не забираются,
+ * потому что их владельцы могут работать с ними без
+ * slab_lock. Вернуть память может только явный вызов
+ * slab_memory_pressure.
+ **/
+slab_header *alloc_new_slab(struct cache *cache)
+{
+    slab_header *slab = static_cast<slab_header *>(alloc_slab(cache->slab_order));
+    if (slab == nullptr)
+    {
+        return nullptr;
+    }
+    size_t first_page = slab_page_index(slab);
+    for (size_t page = 0; page < (size_t(1) << cache->slab_order); page++)
+    {
+        slab_page_owner[first_page + page] = cache;
+    }
+    slab->free_slabs_count = cache->slab_objects;
+    slab->next = nullptr;
+    slab->prev = nullptr;
+
+    // Раскраска slab-ов (Bonwick): slab-ы выровнены на свой размер, поэтому без
+    // сдвига первые объекты всех slab-ов попадали бы в одни и те же сеты кеша.
+    // Каждый новый slab сдвигает область объектов на следующую кеш линию из остатка.
+    slab->colour = cache->colour_next;
+    cache->colour_next = (cache->colour_next + 1) % cache->colours;
+
+    // Свободный список нарезается лениво: новые объекты выдаются по bump_object,
+    // поэтому создание slab-а стоит O(1), а страницы slab-а трогаются только
+    // тогда, когда из них действительно выдают объекты
+    slab->next_free_object = nullptr;
+    slab->bump_object = slab_first_object(cache, slab);
+
+    trace_event(EVENT_SLAB_CREATED, cache, slab, slab->colour);
+    return slab;
+}
+
+void remove_slab_from_list(slab_header *slab)
+{
+    if (slab->prev != nullptr)
+    {
+        slab->prev->next = slab->next;
+    }
+    if (slab->next != nullptr)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * Вставляет slab в связанный список перед next_slab.
+ */
+void add_slab_before_next_slab(slab_header *slab, slab_header *next_slab)
+{
+    slab->next = next_slab;
+    slab->prev = nullptr;
+    if (slab->next != nullptr)
+    {
+        slab->prev = slab->next->prev;
+        slab->next->prev = slab;
+    }
+}
+
+void cache_setup_order(struct cache *cache, size_t object_size, int slab_order);
+
+/**
+ * Функция инициализации будет вызвана перед тем, как
+ * использовать это кеширующий аллокатор для аллокации.
+ * Параметры:
+ *  - cache - структура, которую вы должны инициализировать
+ *  - object_size - размер объектов, которые должен
+ *    аллоцировать этот кеширующий аллокатор
+ **/
+void cache_setup(struct cache *cache, size_t object_size)
+{
+    cache_setup_order(cache, object_size, calc_slab_order(object_size));
+}
+
+/**
+ * То же, что cache_setup, но с заданным порядком slab-а
+ * вместо выбранного calc_slab_order.
+ **/
+void cache_setup_order(struct cache *cache, size_t object_size, int slab_order)
+{
+    cache->empty_slabs = nullptr;
+    cache->active_slabs = nullptr;
+    cache->full_slabs = nullptr;
+
+    cache->object_size = object_size;
+    cache->slab_order = slab_order;
+    cache->slab_size = calc_slab_size(cache->slab_order);
+    cache->object_stride = calc_object_stride(cache->object_size);
+    cache->objects_offset = calc_objects_offset(cache->object_stride);
+    cache->slab_objects = calc_slab_objects(cache->slab_size, cache->object_size);
+    cache->colours = calc_slab_colours(cache->slab_size, cache->object_size);
+    cache->colour_next = 0;
+    cache->free_link_offset = 0;
+    cache->ctor = nullptr;
+    cache->dtor = nullptr;
+    cache->ctor_arg = nullptr;
+
+    spin_lock_init(&cache->slab_lock);
+    spin_lock_init(&cache->depot_lock);
+    cache->depot_full = magazine_list();
+    cache->depot_empty = magazine_list();
+    for (int cpu = 0; cpu < MAGAZINE_CPUS; cpu++)
+    {
+        spin_lock_init(&cache->cpus[cpu].lock);
+        cache->cpus[cpu].loaded = nullptr;
+        cache->cpus[cpu].previous = nullptr;
+    }
+    cache->min_empty_slabs = SLAB_DEFAULT_MIN_EMPTY;
+    cache_register(cache);
+    trace_event(EVENT_CACHE_SETUP, cache, nullptr, cache->object_size);
+}
+
+/**
+ * Кеш сконструированных объектов (Bonwick, "The Slab
+ * Allocator: An Object-Caching Kernel Memory Allocator").
+ * ctor вызывается для объекта, когда его впервые выдают
+ * из slab-а, dtor - когда slab возвращается в buddy, а между
+ * ними объект переходит между cache_alloc и cache_free в
+ * сконструированном виде. Поэтому пользователь обязан
+ * возвращать объект в том же состоянии, в каком получил.
+ * Ссылка свободного списка кладется за объектом, а сам
+ * слот выравнивается на 16 байт.
+ **/
+void cache_setup_ctor(struct cache *cache, size_t object_size,
+                      void (*ctor)(void *object, void *arg),
+                      void (*dtor)(void *object, void *arg), void *arg)
+{
+    size_t link_offset = (object_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    size_t layout_size = (link_offset + sizeof(slab_free_object) + 15) & ~size_t(15);
+    cache_setup(cache, layout_size);
+    cache->object_size = object_size;
+    cache->free_link_offset = link_offset;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->ctor_arg = arg;
+}
+
+/**
+ * Возвращает slab в buddy, перед этим разрушив все его
+ * сконструированные объекты (до bump_object), если у кеша
+ * есть dtor.
+ **/
+void destroy_slab(struct cache *cache, slab_header *slab)
+{
+    if (cache->dtor != nullptr)
+    {
+        for (uint8_t *object = slab_first_object(cache, slab); object < slab->bump_object;
+             object += cache->object_stride)
+        {
+            cache->dtor(object, cache->ctor_arg);
+        }
+    }
+    trace_event(EVENT_SLAB_FREED, cache, slab, 0);
+    free_slab(slab);
+}
+
+/**
+ * Освобождает все slab-ы в списке, начиная с переданного slab-а.
+ * Возвращает количество освобожденных slab-ов.
+ */
+size_t free_cached_slabs(struct cache *cache, slab_header *slab)
+{
+    size_t freed = 0;
+    slab_header *curr_slab = slab;
+    while (curr_slab != nullptr)
+    {
+        slab_header *next_slab = curr_slab->next;
+        curr_slab->next = nullptr;
+        destroy_slab(cache, curr_slab);
+        curr_slab = next_slab;
+        freed++;
+    }
+    return freed;
+}
+
+void cache_purge_magazines(struct cache *cache);
+void release_magazine_cache();
+
+/**
+ * Функция освобождения будет вызвана когда работа с
+ * аллокатором будет закончена. Она должна освободить
+ * всю память занятую аллокатором. Проверяющая система
+ * будет считать ошибкой, если не вся память будет
+ * освбождена.
+ **/
+void cache_release(struct cache *cache)
+{
+    cache_unregister(cache);
+    cache_purge_magazines(cache);
+    release_magazine_cache();
+    free_cached_slabs(cache, cache->empty_slabs);
+    cache->empty_slabs = nullptr;
+    free_cached_slabs(cache, cache->active_slabs);
+    cache->active_slabs = nullptr;
+    free_cached_slabs(cache, cache->full_slabs);
+    cache->full_slabs = nullptr;
+}
+
+/**
+ * Возвращает slab, из которого будет производиться аллокация.
+ * В приоритете берется активный slab, после чего пытается вернуться empty_slab.
+ * Если нет slab-ов, то будет создан новый.
+ */
+slab_header *get_slab_to_alloc(struct cache *cache)
+{
+    if (cache->active_slabs != nullptr)
+    {
+        return cache->active_slabs;
+    }
+    if (cache->empty_slabs != nullptr)
+    {
+        return cache->empty_slabs;
+    }
+    return alloc_new_slab(cache);
+}
+
+/**
+ * Функция аллокации памяти из кеширующего аллокатора.
+ * Должна возвращать указатель на участок памяти размера
+ * как минимум object_size байт (см cache_setup).
+ * Гарантируется, что cache указывает на корректный
+ * инициализированный аллокатор.
+ **/
+void *cache_alloc(struct cache *cache)
+{
+    slab_header *slab = get_slab_to_alloc(cache);
+    if (slab == nullptr)
+    {
+        return nullptr;
+    }
+    void *object = slab_take_object(cache, slab);
+    bool was_empty_slab = slab->free_slabs_count == cache->slab_objects;
+
+    if (was_empty_slab)
+    {
+        // Перестали быть пустыми
+        remove_slab_from_list(slab);
+        if (cache->empty_slabs == slab)
+        {
+            // мы первый элемент - двигаем список
+            cache->empty_slabs = slab->next;
+        }
+    }
+
+    slab->free_slabs_count--;
+    if (slab->free_slabs_count == 0)
+    {
+        // стали полностью заполненными
+        if (!was_empty_slab)
+        {
+            // перестали быть частично заполнеными
+            remove_slab_from_list(slab);
+            if (cache->active_slabs == slab)
+            {
+                // мы первый элемент - двигаем список
+                cache->active_slabs = slab->next;
+            }
+        }
+        add_slab_before_next_slab(slab, cache->full_slabs);
+        cache->full_slabs = slab;
+        trace_event(EVENT_SLAB_TO_FULL, cache, slab, 0);
+    } else if (was_empty_slab) {
+        // Стали именно активными
+        add_slab_before_next_slab(slab, cache->active_slabs);
+        cache->active_slabs = slab;
+        trace_event(EVENT_SLAB_TO_ACTIVE, cache, slab, 0);
+    }
+
+    return object;
+}
+
+/**
+ * Функция освобождения памяти назад в кеширующий аллокатор.
+ * Гарантируется, что ptr - указатель ранее возвращенный из
+ * cache_alloc.
+ **/
+void cache_free(struct cache *cache, void *ptr)
+{
+    // заголовка нет - ссылку на следующий свободный объект пишем в сам объект
+    // (в кешах с конструктором - сразу за ним)
+    slab_free_object *slab_object = object_link(cache, ptr);
+
+    slab_header *slab = get_slab_ptr(cache, ptr);
+    slab_object->next_object = slab->next_free_object;
+    slab->next_free_object = slab_object;
+
+    bool was_full = slab->free_slabs_count == 0;
+    slab->free_slabs_count++;
+
+    if (was_full)
+    {
+        // были полностью заняты
+        remove_slab_from_list(slab);
+        if (cache->full_slabs == slab)
+        {
+            // мы первый элемент - двигаем список
+            cache->full_slabs = slab->next;
+        }
+    }
+
+    if (slab->free_slabs_count == cache->slab_objects)
+    {
+        // стали пустыми
+        if (!was_full)
+        {
+            // перестали быть частично заполнеными
+            remove_slab_from_list(slab);
+            if (cache->active_slabs == slab)
+            {
+                // мы первый элемент - двигаем список
+                cache->active_slabs = slab->next;
+            }
+        }
+        add_slab_before_next_slab(slab, cache->empty_slabs);
+        cache->empty_slabs = slab;
+        slab->empty_since = slab_clock.load(std::memory_order_relaxed);
+        trace_event(EVENT_SLAB_TO_EMPTY, cache, slab, 0);
+    } else if (was_full) {
+        // Стали именно активными
+        add_slab_before_next_slab(slab, cache->active_slabs);
+        cache->active_slabs = slab;
+        trace_event(EVENT_SLAB_TO_ACTIVE, cache, slab, 0);
+    }
+}
+
+/**
+ * Убирает slab из списка с головой *list.
+ **/
+void detach_slab(slab_header **list, slab_header *slab)
+{
+    remove_slab_from_list(slab);
+    if (*list == slab)
+    {
+        *list = slab->next;
+    }
+}
+
+/**
+ * Кладет slab в начало списка с головой *list.
+ **/
+void attach_slab(slab_header **list, slab_header *slab)
+{
+    add_slab_before_next_slab(slab, *list);
+    *list = slab;
+}
+
+/**
+ * Аллоцирует n объектов и складывает их в out. В отличие
+ * от n вызовов cache_alloc, забирает из slab-а сразу
+ * столько объектов, сколько нужно или сколько в нем есть,
+ * и переносит slab между списками один раз. Возвращает,
+ * сколько объектов удалось аллоцировать (меньше n, только
+ * если закончилась память под slab-ы).
+ **/
+size_t cache_alloc_bulk(struct cache *cache, size_t n, void **out)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        slab_header *slab = get_slab_to_alloc(cache);
+        if (slab == nullptr)
+        {
+            break;
+        }
+        bool was_empty_slab = slab->free_slabs_count == cache->slab_objects;
+        detach_slab(was_empty_slab ? &cache->empty_slabs : &cache->active_slabs, slab);
+
+        size_t take = n - done < slab->free_slabs_count ? n - done : slab->free_slabs_count;
+        for (size_t i = 0; i < take; i++)
+        {
+            out[done++] = slab_take_object(cache, slab);
+        }
+        slab->free_slabs_count -= take;
+
+        if (slab->free_slabs_count == 0)
+        {
+            attach_slab(&cache->full_slabs, slab);
+            trace_event(EVENT_SLAB_TO_FULL, cache, slab, 0);
+        }
+        else
+        {
+            attach_slab(&cache->active_slabs, slab);
+            if (was_empty_slab)
+            {
+                trace_event(EVENT_SLAB_TO_ACTIVE, cache, slab, 0);
+            }
+        }
+    }
+    return done;
+}
+
+/**
+ * Возвращает в slab цепочку из count объектов от first до
+ * last и переносит slab в нужный список один раз.
+ **/
+void cache_free_chain(struct cache *cache, slab_header *slab, slab_free_object *first,
+                      slab_free_object *last, size_t count)
+{
+    last->next_object = slab->next_free_object;
+    slab->next_free_object = first;
+
+    bool was_full = slab->free_slabs_count == 0;
+    slab->free_slabs_count += count;
+    bool is_empty = slab->free_slabs_count == cache->slab_objects;
+    if (!was_full && !is_empty)
+    {
+        return;
+    }
+
+    detach_slab(was_full ? &cache->full_slabs : &cache->active_slabs, slab);
+    if (is_empty)
+    {
+        attach_slab(&cache->empty_slabs, slab);
+        slab->empty_since = slab_clock.load(std::memory_order_relaxed);
+        trace_event(EVENT_SLAB_TO_EMPTY, cache, slab, 0);
+    }
+    else
+    {
+        attach_slab(&cache->active_slabs, slab);
+        trace_event(EVENT_SLAB_TO_ACTIVE, cache, slab, 0);
+    }
+}
+
+/**
+ * Освобождает n объектов из ptrs. Подряд идущие объекты
+ * одного slab-а собираются в цепочку и возвращаются в slab
+ * за один раз, поэтому пачка, аллоцированная через
+ * cache_alloc_bulk, делает по одному переходу на slab.
+ **/
+void cache_free_bulk(struct cache *cache, size_t n, void **ptrs)
+{
+    size_t i = 0;
+    while (i < n)
+    {
+        slab_header *slab = get_slab_ptr(cache, ptrs[i]);
+        slab_free_object *first = object_link(cache, ptrs[i]);
+        slab_free_object *last = first;
+        size_t count = 1;
+        for (i++; i < n && get_slab_ptr(cache, ptrs[i]) == slab; i++, count++)
+        {
+            slab_free_object *object = object_link(cache, ptrs[i]);
+            last->next_object = object;
+            last = object;
+        }
+        cache_free_chain(cache, slab, first, last, count);
+    }
+}
+
+/**
+ * Функция должна освободить все SLAB, которые не содержат
+ * занятых объектов. Если SLAB не использовался для аллокации
+ * объектов (например, если вы выделяли с помощью alloc_slab
+ * память для внутренних нужд вашего алгоритма), то освбождать
+ * его не обязательно.
+ **/
+void cache_shrink(struct cache *cache)
+{
+    // Объекты из магазинов для slab-ов все еще заняты - возвращаем их,
+    // иначе slab-ы с такими объектами нельзя будет освободить
+    cache_purge_magazines(cache);
+
+    spin_lock(&cache->slab_lock);
+    size_t reclaimed = free_cached_slabs(cache, cache->empty_slabs);
+    cache->empty_slabs = nullptr;
+    spin_unlock(&cache->slab_lock);
+    trace_event(EVENT_SHRINK_RECLAIM, cache, nullptr, reclaimed);
+}
+
+/**
+ * cache_shrink по условию задачи возвращает все пустые
+ * slab-ы сразу, и следующий всплеск аллокаций снова идет в
+ * buddy. Поэтому для фоновой работы есть caches_reap с
+ * гистерезисом: у каждого кеша остается min_empty_slabs
+ * самых свежих пустых slab-ов, а остальные возвращаются,
+ * только если пролежали пустыми SLAB_REAP_AGE тиков.
+ **/
+void cache_set_min_empty_slabs(struct cache *cache, size_t min_empty_slabs)
+{
+    spin_lock(&cache->slab_lock);
+    cache->min_empty_slabs = min_empty_slabs;
+    spin_unlock(&cache->slab_lock);
+}
+
+/**
+ * Освобождает пустой slab из списка empty_slabs.
+ * Вызывается под slab_lock.
+ **/
+void cache_free_empty_slab(struct cache *cache, slab_header *slab)
+{
+    detach_slab(&cache->empty_slabs, slab);
+    destroy_slab(cache, slab);
+}
+
+size_t cache_reap(struct cache *cache, uint64_t now)
+{
+    size_t reclaimed = 0;
+    size_t kept = 0;
+    slab_header *slab = cache->empty_slabs;
+    // В начале списка самые свежие пустые slab-ы - их и оставляем
+    while (slab != nullptr)
+    {
+        slab_header *next_slab = slab->next;
+        if (kept < cache->min_empty_slabs || now - slab->empty_since < SLAB_REAP_AGE)
+        {
+            kept++;
+        }
+        else
+        {
+            cache_free_empty_slab(cache, slab);
+            reclaimed++;
+        }
+        slab = next_slab;
+    }
+    return reclaimed;
+}
+
+void cache_trim_depot(struct cache *cache, magazine **unused);
+void magazine_free(magazine *mag);
+
+/**
+ * Периодическая работа (как cache_reap в Linux): продвигает
+ * slab_clock, урезает depot каждого кеша до рабочего набора
+ * (см. cache_trim_depot) и возвращает старые пустые slab-ы.
+ * Кеши, чей slab_lock сейчас занят, пропускаются до
+ * следующего тика. Возвращает освобожденные байты.
+ *
+ * Списки slab-ов защищает только slab_lock, а его берут
+ * cache_alloc_mt/cache_free_mt и служебные пути, но не
+ * однопоточные cache_alloc, cache_free, bulk-функции, kmalloc
+ * и SlabPool. Поэтому из другого потока caches_reap и
+ * slab_memory_pressure можно вызывать, только если
+ * остальные кеши используются через _mt-функции; кеши с
+ * однопоточными вызовами нужно обслуживать из того же
+ * потока, который ими пользуется.
+ **/
+size_t caches_reap()
+{
+    uint64_t now = slab_clock.fetch_add(1, std::memory_order_relaxed) + 1;
+    size_t reclaimed_bytes = 0;
+    magazine *unused_magazines = nullptr;
+    spin_lock(&cache_registry_lock);
+    for (struct cache *cache = cache_registry; cache != nullptr; cache = cache->registry_next)
+    {
+        if (!spin_trylock(&cache->slab_lock))
+        {
+            continue;
+        }
+        cache_trim_depot(cache, &unused_magazines);
+        size_t reclaimed = cache_reap(cache, now);
+        spin_unlock(&cache->slab_lock);
+        reclaimed_bytes += reclaimed * cache->slab_size;
+        if (reclaimed != 0)
+        {
+            trace_event(EVENT_SHRINK_RECLAIM, cache, nullptr, reclaimed);
+        }
+    }
+    spin_unlock(&cache_registry_lock);
+    while (unused_magazines != nullptr)
+    {
+        magazine *next = unused_magazines->next;
+        magazine_free(unused_magazines);
+        unused_magazines = next;
+    }
+    return reclaimed_bytes;
+}
+
+size_t count_empty_slabs(struct cache *cache)
+{
+    size_t count = 0;
+    for (slab_header *slab = cache->empty_slabs; slab != nullptr; slab = slab->next)
+    {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Точка входа для колбэка нехватки памяти: вернуть около
+ * target_bytes. Каждый кеш отдает долю target_bytes,
+ * пропорциональную своей простаивающей памяти (байтам в
+ * пустых slab-ах), начиная с самых старых пустых slab-ов.
+ * В отличие от caches_reap, min_empty_slabs здесь не
+ * соблюдается. Кеши, чей slab_lock держит другой поток,
+ * пропускаются. Возвращает освобожденные байты. Про
+ * вызовы из других потоков см. caches_reap.
+ **/
+size_t slab_memory_pressure(size_t target_bytes)
+{
+    size_t reclaimed_bytes = 0;
+    spin_lock(&cache_registry_lock);
+    size_t idle_bytes = 0;
+    for (struct cache *cache = cache_registry; cache != nullptr; cache = cache->registry_next)
+    {
+        if (spin_trylock(&cache->slab_lock))
+        {
+            idle_bytes += count_empty_slabs(cache) * cache->slab_size;
+            spin_unlock(&cache->slab_lock);
+        }
+    }
+
+    for (struct cache *cache = cache_registry; cache != nullptr && idle_bytes != 0; cache = cache->registry_next)
+    {
+        if (!spin_trylock(&cache->slab_lock))
+        {
+            continue;
+        }
+        size_t cache_idle = count_empty_slabs(cache) * cache->slab_size;
+        // Доля с округлением вверх, чтобы отдать хотя бы один slab
+        size_t share = target_bytes >= idle_bytes
+                           ? cache_idle
+                           : (target_bytes * cache_idle + idle_bytes - 1) / idle_bytes;
+        size_t reclaimed = 0;
+        slab_header *slab = cache->empty_slabs;
+        while (slab != nullptr && slab->next != nullptr)
+        {
+            slab = slab->next;
+        }
+        // Идем с хвоста списка: там самые старые пустые slab-ы
+        while (slab != nullptr && reclaimed * cache->slab_size < share)
+        {
+            slab_header *prev_slab = slab->prev;
+            cache_free_empty_slab(cache, slab);
+            reclaimed++;
+            slab = prev_slab;
+        }
+        spin_unlock(&cache->slab_lock);
+        reclaimed_bytes += reclaimed * cache->slab_size;
+        if (reclaimed != 0)
+        {
+            trace_event(EVENT_SHRINK_RECLAIM, cache, nullptr, reclaimed);
+        }
+    }
+    spin_unlock(&cache_registry_lock);
+    return reclaimed_bytes;
+}
+
+static const size_t MAX_COLOUR_STATS = 64;
+
+/**
+ * Статистика раскраски: сколько цветов у кеша, на какой
+ * цвет будет создан следующий slab и сколько живых slab-ов
+ * каждого цвета (цвета старше MAX_COLOUR_STATS - 1
+ * считаются в последнем элементе).
+ **/
+struct cache_colour_stats
+{
+    size_t colours;
+    size_t colour_next;
+    size_t leftover_bytes; /* остаток slab-а, который делится на цвета */
+    size_t slabs_by_colour[MAX_COLOUR_STATS];
+};
+
+void count_slab_colours(slab_header *slab, cache_colour_stats *stats)
+{
+    for (; slab != nullptr; slab = slab->next)
+    {
+        size_t colour = slab->colour < MAX_COLOUR_STATS ? slab->colour : MAX_COLOUR_STATS - 1;
+        stats->slabs_by_colour[colour]++;
+    }
+}
+
+cache_colour_stats cache_get_colour_stats(struct cache *cache)
+{
+    cache_colour_stats stats = {};
+    stats.colours = cache->colours;
+    stats.leftover_bytes = cache->slab_size - cache->objects_offset -
+                           cache->slab_objects * cache->object_stride;
+
+    spin_lock(&cache->slab_lock);
+    stats.colour_next = cache->colour_next;
+    count_slab_colours(cache->empty_slabs, &stats);
+    count_slab_colours(cache->active_slabs, &stats);
+    count_slab_colours(cache->full_slabs, &stats);
+    spin_unlock(&cache->slab_lock);
+    return stats;
+}
+
+/**
+ * Кеш, из которого аллоцируются магазины всех кешей. Он в
+ * реестре, поэтому его списки, как у всех кешей, защищает
+ * slab_lock; magazine_cache_lock нужен только для ленивого
+ * cache_setup.
+ **/
+struct cache magazine_cache;
+spinlock magazine_cache_lock;
+bool magazine_cache_ready = false;
+
+magazine *magazine_alloc()
+{
+    spin_lock(&magazine_cache_lock);
+    if (!magazine_cache_ready)
+    {
+        cache_setup(&magazine_cache, sizeof(magazine));
+        magazine_cache_ready = true;
+    }
+    spin_unlock(&magazine_cache_lock);
+
+    spin_lock(&magazine_cache.slab_lock);
+    magazine *mag = static_cast<magazine *>(cache_alloc(&magazine_cache));
+    spin_unlock(&magazine_cache.slab_lock);
+    if (mag == nullptr)
+    {
+        return nullptr;
+    }
+
+    mag->next = nullptr;
+    mag->rounds = 0;
+    return mag;
+}
+
+void magazine_free(magazine *mag)
+{
+    spin_lock(&magazine_cache.slab_lock);
+    cache_free(&magazine_cache, mag);
+    spin_unlock(&magazine_cache.slab_lock);
+}
+
+/**
+ * Возвращает SLAB-ы магазинов, которые больше не используются.
+ **/
+void release_magazine_cache()
+{
+    spin_lock(&magazine_cache_lock);
+    bool ready = magazine_cache_ready;
+    spin_unlock(&magazine_cache_lock);
+    if (!ready)
+    {
+        return;
+    }
+    spin_lock(&magazine_cache.slab_lock);
+    free_cached_slabs(&magazine_cache, magazine_cache.empty_slabs);
+    magazine_cache.empty_slabs = nullptr;
+    spin_unlock(&magazine_cache.slab_lock);
+}
+
+int current_cpu()
+{
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0)
+    {
+        return cpu % MAGAZINE_CPUS;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Возвращает объекты магазина в slab-ы и освобождает сам магазин.
+ **/
+void flush_magazine(struct cache *cache, magazine *mag)
+{
+    if (mag == nullptr)
+    {
+        return;
+    }
+    spin_lock(&cache->slab_lock);
+    for (size_t i = 0; i < mag->rounds; i++)
+    {
+        cache_free(cache, mag->objects[i]);
+    }
+    spin_unlock(&cache->slab_lock);
+    magazine_free(mag);
+}
+
+void flush_magazine_list(struct cache *cache, magazine *mag)
+{
+    while (mag != nullptr)
+    {
+        magazine *next = mag->next;
+        flush_magazine(cache, mag);
+        mag = next;
+    }
+}
+
+/**
+ * Операции со списками depot, вызываются под depot_lock.
+ **/
+void magazine_list_push(magazine_list *list, magazine *mag)
+{
+    mag->next = list->head;
+    list->head = mag;
+    list->count++;
+}
+
+magazine *magazine_list_pop(magazine_list *list)
+{
+    magazine *mag = list->head;
+    if (mag == nullptr)
+    {
+        return nullptr;
+    }
+    list->head = mag->next;
+    list->count--;
+    if (list->count < list->min_count)
+    {
+        list->min_count = list->count;
+    }
+    return mag;
+}
+
+/**
+ * Снимает с начала списка магазины, которые не понадобились
+ * с прошлого вызова (min_count), и начинает новый интервал.
+ * Возвращает снятые магазины цепочкой через next.
+ **/
+magazine *magazine_list_trim(magazine_list *list)
+{
+    magazine *unused = nullptr;
+    for (size_t i = list->min_count; i > 0; i--)
+    {
+        magazine *mag = magazine_list_pop(list);
+        mag->next = unused;
+        unused = mag;
+    }
+    list->min_count = list->count;
+    return unused;
+}
+
+/**
+ * Возвращает в slab-ы все объекты из магазинов CPU и depot.
+ **/
+void cache_purge_magazines(struct cache *cache)
+{
+    for (int cpu = 0; cpu < MAGAZINE_CPUS; cpu++)
+    {
+        cpu_magazines *magazines = &cache->cpus[cpu];
+        spin_lock(&magazines->lock);
+        flush_magazine(cache, magazines->loaded);
+        flush_magazine(cache, magazines->previous);
+        magazines->loaded = nullptr;
+        magazines->previous = nullptr;
+        spin_unlock(&magazines->lock);
+    }
+
+    spin_lock(&cache->depot_lock);
+    magazine *full = cache->depot_full.head;
+    magazine *empty = cache->depot_empty.head;
+    cache->depot_full = magazine_list();
+    cache->depot_empty = magazine_list();
+    spin_unlock(&cache->depot_lock);
+
+    flush_magazine_list(cache, full);
+    flush_magazine_list(cache, empty);
+}
+
+/**
+ * Рабочий набор depot (Bonwick, Adams): магазины, которые ни
+ * разу не понадобились с прошлого caches_reap, снимаются, а
+ * объекты полных из них возвращаются в slab-ы. Вызывается
+ * под slab_lock, поэтому сами магазины не освобождает, а
+ * добавляет в цепочку unused для magazine_free.
+ **/
+void cache_trim_depot(struct cache *cache, magazine **unused)
+{
+    spin_lock(&cache->depot_lock);
+    magazine *full = magazine_list_trim(&cache->depot_full);
+    magazine *empty = magazine_list_trim(&cache->depot_empty);
+    spin_unlock(&cache->depot_lock);
+
+    while (full != nullptr)
+    {
+        magazine *next = full->next;
+        for (size_t i = 0; i < full->rounds; i++)
+        {
+            cache_free(cache, full->objects[i]);
+        }
+        full->next = *unused;
+        *unused = full;
+        full = next;
+    }
+    while (empty != nullptr)
+    {
+        magazine *next = empty->next;
+        empty->next = *unused;
+        *unused = empty;
+        empty = next;
+    }
+}
+
+/**
+ * Многопоточная аллокация через магазины. Объект берется из
+ * магазина текущего CPU, пустой магазин меняется на полный из
+ * depot, и только если полных магазинов нет, объект берется из
+ * slab-ов под общей блокировкой. Не смешивать с cache_alloc/
+ * cache_free на одном кеше из разных потоков.
+ **/
+void *cache_alloc_mt(struct cache *cache)
+{
+    cpu_magazines *magazines = &cache->cpus[current_cpu()];
+    spin_lock(&magazines->lock);
+    for (;;)
+    {
+        if (magazines->loaded != nullptr && magazines->loaded->rounds > 0)
+        {
+            void *object = magazines->loaded->objects[--magazines->loaded->rounds];
+            spin_unlock(&magazines->lock);
+            return object;
+        }
+        if (magazines->previous != nullptr && magazines->previous->rounds > 0)
+        {
+            magazine *loaded = magazines->loaded;
+            magazines->loaded = magazines->previous;
+            magazines->previous = loaded;
+            continue;
+        }
+
+        // Оба магазина пусты - отдаем previous в depot и берем оттуда полный
+        spin_lock(&cache->depot_lock);
+        magazine *full = magazine_list_pop(&cache->depot_full);
+        if (full == nullptr)
+        {
+            spin_unlock(&cache->depot_lock);
+            break;
+        }
+        if (magazines->previous != nullptr)
+        {
+            magazine_list_push(&cache->depot_empty, magazines->previous);
+        }
+        spin_unlock(&cache->depot_lock);
+        magazines->previous = magazines->loaded;
+        magazines->loaded = full;
+    }
+    spin_unlock(&magazines->lock);
+
+    spin_lock(&cache->slab_lock);
+    void *object = cache_alloc(cache);
+    spin_unlock(&cache->slab_lock);
+    return object;
+}
+
+/**
+ * Многопоточное освобождение через магазины: объект кладется
+ * в магазин текущего CPU, полный магазин меняется на пустой
+ * из depot (или новый). В depot_full попадают только полные
+ * магазины: previous с местом забирается обменом, а если не
+ * удалось взять даже новый магазин, магазины CPU остаются
+ * как были и объект уходит прямо в slab.
+ **/
+void cache_free_mt(struct cache *cache, void *ptr)
+{
+    cpu_magazines *magazines = &cache->cpus[current_cpu()];
+    spin_lock(&magazines->lock);
+    for (;;)
+    {
+        if (magazines->loaded != nullptr && magazines->loaded->rounds < MAGAZINE_SIZE)
+        {
+            magazines->loaded->objects[magazines->loaded->rounds++] = ptr;
+            spin_unlock(&magazines->lock);
+            return;
+        }
+        if (magazines->previous != nullptr && magazines->previous->rounds < MAGAZINE_SIZE)
+        {
+            magazine *loaded = magazines->loaded;
+            magazines->loaded = magazines->previous;
+            magazines->previous = loaded;
+            continue;
+        }
+
+        // Оба магазина полны (или их нет) - берем пустой из depot или новый
+        spin_lock(&cache->depot_lock);
+        magazine *empty = magazine_list_pop(&cache->depot_empty);
+        spin_unlock(&cache->depot_lock);
+        if (empty == nullptr)
+        {
+            empty = magazine_alloc();
+        }
+        if (empty == nullptr)
+        {
+            // Нет памяти даже под магазин - возвращаем объект прямо в slab
+            spin_unlock(&magazines->lock);
+            spin_lock(&cache->slab_lock);
+            cache_free(cache, ptr);
+            spin_unlock(&cache->slab_lock);
+            return;
+        }
+        if (magazines->previous != nullptr)
+        {
+            spin_lock(&cache->depot_lock);
+            magazine_list_push(&cache->depot_full, magazines->previous);
+            spin_unlock(&cache->depot_lock);
+        }
+        magazines->previous = magazines->loaded;
+        magazines->loaded = empty;
+    }
+}
+
+/**
+ * kmalloc/kfree - аллокатор произвольного размера поверх
+ * лестницы кешей, как kmalloc-<size> в Linux. Порядок slab-а
+ * каждого кеша лестницы выбирает calc_slab_order, а kfree
+ * находит кеш объекта по slab_page_owner его страницы.
+ * Запросы больше KMALLOC_MAX_CACHE_SIZE идут сразу в
+ * alloc_slab: у такого участка в начале лежит
+ * kmalloc_large_header, а в slab_page_owner его первой
+ * страницы записан nullptr.
+ * Как и cache_alloc, работает из одного потока.
+ **/
+static const size_t KMALLOC_MAX_CACHE_SIZE = 4096;
+static const size_t kmalloc_sizes[] = {8, 16, 32, 64, 96, 128, 192, 256, 512, 1024, 2048, 4096};
+static const int KMALLOC_CLASSES = sizeof(kmalloc_sizes) / sizeof(kmalloc_sizes[0]);
+
+/**
+ * Номер кеша для размеров до 192 байт по (size - 1) / 8:
+ * так 96 и 192 попадают в свои промежуточные классы.
+ **/
+static const uint8_t kmalloc_small_index[24] = {0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+                                                5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6};
+
+struct kmalloc_large_header
+{
+    int order;
+};
+
+static const size_t KMALLOC_LARGE_OFFSET = (sizeof(kmalloc_large_header) + 15) & ~size_t(15);
+
+struct cache kmalloc_caches[KMALLOC_CLASSES];
+bool kmalloc_ready = false;
+size_t kmalloc_large_bytes = 0; /* сколько памяти занято большими аллокациями */
+
+int kmalloc_index(size_t size)
+{
+    if (size <= 192)
+    {
+        return kmalloc_small_index[(size - 1) / 8];
+    }
+    // 193..256 -> 7, 257..512 -> 8, ...
+    return 64 - __builtin_clzll(size - 1) - 1;
+}
+
+/**
+ * Повторный вызов без kmalloc_release ничего не делает:
+ * иначе кеши лестницы второй раз попали бы в реестр.
+ **/
+void kmalloc_setup()
+{
+    if (kmalloc_ready)
+    {
+        return;
+    }
+    for (int i = 0; i < KMALLOC_CLASSES; i++)
+    {
+        cache_setup(&kmalloc_caches[i], kmalloc_sizes[i]);
+    }
+    kmalloc_large_bytes = 0;
+    kmalloc_ready = true;
+}
+
+/**
+ * Освобождает slab-ы всех кешей лестницы. Большие
+ * аллокации, которые не вернули через kfree, остаются.
+ **/
+void kmalloc_release()
+{
+    if (!kmalloc_ready)
+    {
+        return;
+    }
+    for (int i = 0; i < KMALLOC_CLASSES; i++)
+    {
+        cache_release(&kmalloc_caches[i]);
+    }
+    kmalloc_ready = false;
+}
+
+void kmalloc_shrink()
+{
+    for (int i = 0; i < KMALLOC_CLASSES; i++)
+    {
+        cache_shrink(&kmalloc_caches[i]);
+    }
+}
+
+void *kmalloc(size_t size)
+{
+    if (size == 0)
+    {
+        return nullptr;
+    }
+    if (size <= KMALLOC_MAX_CACHE_SIZE)
+    {
+        return cache_alloc(&kmalloc_caches[kmalloc_index(size)]);
+    }
+
+    int order = 0;
+    while (order <= SLAB_MAX_ORDER && calc_slab_size(order) - KMALLOC_LARGE_OFFSET < size)
+    {
+        order++;
+    }
+    if (order > SLAB_MAX_ORDER)
+    {
+        return nullptr;
+    }
+    kmalloc_large_header *header = static_cast<kmalloc_large_header *>(alloc_slab(order));
+    if (header == nullptr)
+    {
+        return nullptr;
+    }
+    header->order = order;
+    slab_page_owner[slab_page_index(header)] = nullptr;
+    kmalloc_large_bytes += calc_slab_size(order);
+    return reinterpret_cast<uint8_t *>(header) + KMALLOC_LARGE_OFFSET;
+}
+
+void kfree(void *ptr)
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+    struct cache *owner = slab_page_owner[slab_page_index(ptr)];
+    if (owner != nullptr)
+    {
+        cache_free(owner, ptr);
+        return;
+    }
+    kmalloc_large_header *header =
+        reinterpret_cast<kmalloc_large_header *>(static_cast<uint8_t *>(ptr) - KMALLOC_LARGE_OFFSET);
+    kmalloc_large_bytes -= calc_slab_size(header->order);
+    free_slab(header);
+}
+
+/**
+ * Типизированный пул поверх кеша с конструктором: объект
+ * T конструируется, когда slab_take_object впервые выдает
+ * его из slab-а, и разрушается, когда slab возвращается в
+ * buddy, а между ними alloc/free только берут и возвращают
+ * готовые объекты. Как и в
+ * cache_setup_ctor, объект нужно возвращать в free в
+ * исходном состоянии (мьютекс отпущен, вектор очищен и
+ * т. п.), иначе следующий alloc получит его как есть.
+ * Дополнительные ctor/dtor вызываются после конструктора
+ * T и перед его деструктором, например чтобы один раз
+ * зарезервировать память во вложенном векторе.
+ **/
+template <typename T>
+class SlabPool
+{
+public:
+    typedef void (*callback)(T *object);
+
+    explicit SlabPool(callback ctor = nullptr, callback dtor = nullptr) : ctor_(ctor), dtor_(dtor)
+    {
+        static_assert(alignof(T) <= 16, "slab objects are aligned to at most 16 bytes");
+        cache_setup_ctor(&cache_, sizeof(T), construct, destroy, this);
+    }
+
+    ~SlabPool() { cache_release(&cache_); }
+
+    SlabPool(const SlabPool &) = delete;
+    SlabPool &operator=(const SlabPool &) = delete;
+
+    T *alloc() { return static_cast<T *>(cache_alloc(&cache_)); }
+
+    void free(T *object) { cache_free(&cache_, object); }
+
+    void shrink() { cache_shrink(&cache_); }
+
+private:
+    static void construct(void *object, void *arg)
+    {
+        SlabPool *pool = static_cast<SlabPool *>(arg);
+        T *value = new (object) T();
+        if (pool->ctor_ != nullptr)
+        {
+            pool->ctor_(value);
+        }
+    }
+
+    static void destroy(void *object, void *arg)
+    {
+        SlabPool *pool = static_cast<SlabPool *>(arg);
+        T *value = static_cast<T *>(object);
+        if (pool->dtor_ != nullptr)
+        {
+            pool->dtor_(value);
+        }
+        value->~T();
+    }
+
+    struct cache cache_;
+    callback ctor_;
+    callback dtor_;
+};
+
+// Демонстрационный main, бенчмарк alloc_bench подключает файл без него
+#ifndef ALLOC_BENCH
+int main(int argc, char const *argv[])
+{
+    struct cache *cache = (struct cache *)std::malloc(sizeof(struct cache));
     cache_setup(cache, 512);
 
+    void *objects[20];
+    for (int i = 0; i < 20; i++)
+    {
+        objects[i] = cache_alloc(cache);
+    }
+    cache_colour_stats colour_stats = cache_get_colour_stats(cache);
+    std::cout << "colours = " << colour_stats.colours
+              << ", leftover = " << colour_stats.leftover_bytes
+              << ", next colour = " << colour_stats.colour_next << "\n";
+    for (int i = 0; i < 20; i++)
+    {
+        cache_free(cache, objects[i]);
+    }
+    cache_shrink(cache);
+    slab_trace_dump(std::cout, 16);
+
+    slab_order_report(std::cout, 192);
+    slab_order_report(std::cout, 1400);
+
+    kmalloc_setup();
+    void *small = kmalloc(100);
+    void *large = kmalloc(100000);
+    std::cout << "kmalloc(100) = " << small << ", kmalloc(100000) takes "
+              << kmalloc_large_bytes << " bytes\n";
+    kfree(small);
+    kfree(large);
+    kmalloc_release();
+
     cache_release(cache);
 
     return 0;
 }
+#endif